@@ -9,6 +9,16 @@ Canvas::Canvas(char* windowTitle, std::string path)
 	height = surface->h;
 	res = width * height;
 
+	jobEventType = SDL_RegisterEvents(1);
+	jobRunning = false;
+	cancelRequested = false;
+	kernelDifference = 0.0f;
+
+	//A 32-bit build can't address more than about 2 GB however much RAM there is
+	memoryBudget = (long long)SDL_GetSystemRAM() * 1024 * 1024 / 2;
+	if (sizeof(void*) == 4)
+		memoryBudget = std::min(memoryBudget, 1536LL * 1024 * 1024);
+
 	Window* mainWindow = createWindow("Main", width, height);
 	
 	//Set PIXEL_FORMAT in Eisel.cpp for use in color conversion, etc...
@@ -16,26 +26,41 @@ Canvas::Canvas(char* windowTitle, std::string path)
 	
 	//Convert surface to screen format and paint on Main window
 	auto optimizedSurface = SDL_ConvertSurface(surface, PIXEL_FORMAT, NULL);
-	sourceImageU32 = convertSurfaceToPixelArray(optimizedSurface);
+	Uint32* pixels = convertSurfaceToPixelArray(optimizedSurface);
+	sourceImage = new LabImage(pixels, width, height);
+	delete[] pixels;
+	SDL_FreeSurface(optimizedSurface);
+	SDL_FreeSurface(surface);
 
-	mainWindow->fillWithImage(convertSurfaceToPixelArray(optimizedSurface));
+	mainWindow->fillWithImage(sourceImage);
 	mainWindow->updateTexture();
 	mainWindow->render();
 }
 
 Canvas::~Canvas()
 {
+	if (jobThread != nullptr)
+	{
+		cancelJob();
+		finishJob(); //Lets the job free whatever it allocated
+	}
+
 	for (int i = windows.size() - 1; i >= 0; --i)
 	{
 		if (windows[i] != nullptr)
 			delete windows[i];
 	}
+	for (auto layer : enhanceLayers)
+	{
+		delete layer;
+	}
+	delete sourceImage;
 }
 
 Window* Canvas::createWindow(const char* title, Window* base)
 {
 	Window* newWindow = new Window(title, base->imgWidth, base->imgHeight, nextWindowPos, nextWindowPos);
-	newWindow->fillWithImage(base->img);
+	newWindow->fillWithImage(base->lab);
 	windows.push_back(newWindow);
 	nextWindowPos += 50;
 	return newWindow;
@@ -70,6 +95,10 @@ void Canvas::handleEvent(SDL_Event& e)
 		{
 			if ((*iter)->windowID == e.window.windowID)
 			{
+				if (*iter == enhanceWindow)
+				{
+					stopEnhancing(false);
+				}
 				delete *iter;
 				windows.erase(iter);
 				break;
@@ -78,351 +107,2711 @@ void Canvas::handleEvent(SDL_Event& e)
 	}
 }
 
-Window* Canvas::runMultiDecomp(Window* base, int k)
+Window* Canvas::runMultiDecomp(Window* base, int k, bool fullColor)
 {
-	std::vector<int>* minima = findMinima(base, k);
-	VectorXf interpLowerValues = interpolateExtrema(base, k, minima);
-	delete minima;
-	std::vector<int>* maxima = findMaxima(base, k);
-	VectorXf interpUpperValues = interpolateExtrema(base, k, maxima);
-	delete maxima;
-
-	VectorXf* avg = new VectorXf((interpLowerValues + interpUpperValues) / 2.0);
+	//The detail window's image and layer, and a Window's own copy of its pixels
+	long long resident = (long long)base->imgWidth * base->imgHeight * (2 * LabImage::PIXEL_BYTES + sizeof(Uint32));
+	DecompositionPlan plan = planDecomposition(base->imgWidth, base->imgHeight, nullptr, k, fullColor, resident);
+	printPlan(plan, k);
 
-	//Create new window with fine detail
+	/*
+	Create new window for the fine detail, then fill it and the base window (coarse detail) in one pass.
+	The detail is taken from the base window's current image, not the source,
+	so decomposing the coarse detail again splits it into the next level down
+	and all the detail layers plus the last coarse layer add back up to the source.
+	*/
 	std::ostringstream stream;
 	stream << "Detail level " << k;
 	Window* fineDetail = createWindow(stream.str().c_str(), base->imgWidth, base->imgHeight);
-	fineDetail->fillWithImage(sourceImageU32);
-	fillWithMultiDecompDetail(fineDetail, avg);
+	fineDetail->layer = new LabImage(base->imgWidth, base->imgHeight);
+	decomposePlanned(base->lab, nullptr, k, fullColor, plan, base->lab, fineDetail->lab, fineDetail->layer);
 	fineDetail->updateTexture();
-
-	//Fill base window with coarse detail
-	base->fillWithImage(sourceImageU32);
-	fillWithMultiDecompResidual(base, avg);
 	base->updateTexture();
 
 	return fineDetail;
 }
 
-void Canvas::reconstructFromDecomps(Window* base, Window* overlay)
+/*
+Same as runMultiDecomp, but the decomposition runs on a worker thread so the UI stays responsive.
+The worker decomposes a copy of the base window's image,
+so the window can still be moved, resized or even closed in the meantime.
+The windows are only touched once the job is finished, back on the main thread.
+Throws DecompositionTooLarge without starting anything if it won't fit in memoryBudget.
+*/
+void Canvas::runMultiDecompInBackground(Window* base, int k, bool fullColor, const SDL_Rect* region)
 {
-	int tempRes = base->imgWidth * base->imgHeight;
+	//The worker's copy of the image and the 2 detail images it fills
+	long long resident = (long long)base->imgWidth * base->imgHeight * 3 * LabImage::PIXEL_BYTES;
+	DecompositionPlan plan = planDecomposition(base->imgWidth, base->imgHeight, region, k, fullColor, resident);
+	printPlan(plan, k);
+
+	LabImage* source = new LabImage(base->imgWidth, base->imgHeight);
+	source->copyFrom(base->lab);
+	LabImage* detailLab = new LabImage(base->imgWidth, base->imgHeight);
+	LabImage* detailLayer = new LabImage(base->imgWidth, base->imgHeight);
 
-	for (int i = 0; i < tempRes; i++)
+	bool wholeImage = region == nullptr;
+	SDL_Rect roi = wholeImage ? SDL_Rect() : *region;
+
+	runInBackground([=]()
+	{
+		if (wholeImage)
+		{
+			decomposePlanned(source, nullptr, k, fullColor, plan, source, detailLab, detailLayer);
+		}
+		else
+		{
+			/*
+			Outside the region the residual is just the image and the detail is 0,
+			so the layers still add back up to the image everywhere.
+			An empty detail layer packs to L = 50, with the residual's color unless it's a full color decomposition.
+			*/
+			detailLab->copyFrom(source);
+			std::fill(detailLab->l, detailLab->l + detailLab->res, 50.0f);
+			if (fullColor)
+			{
+				std::fill(detailLab->a, detailLab->a + detailLab->res, 0.0f);
+				std::fill(detailLab->b, detailLab->b + detailLab->res, 0.0f);
+			}
+			detailLab->updateLuminance();
+			decomposePlanned(source, &roi, k, fullColor, plan, source, detailLab, detailLayer);
+		}
+	},
+	[=](bool completed)
 	{
-		double l = toLAB(overlay->img[i]).l;
-		l = l * 2.0 - 100.0;
+		if (completed && hasWindow(base))
+		{
+			base->fillWithImage(source);
+			base->updateTexture();
 
-		ColorLAB lab = toLAB(base->img[i]);
-		lab.l += l;
-		base->img[i] = toSDL(lab);
-	}
+			std::ostringstream stream;
+			stream << "Detail level " << k;
+			Window* fineDetail = createWindow(stream.str().c_str(), base->imgWidth, base->imgHeight);
+			fineDetail->fillWithImage(detailLab);
+			fineDetail->layer = detailLayer;
+			fineDetail->updateTexture();
+		}
+		else
+		{
+			delete detailLayer;
+		}
+		delete source;
+		delete detailLab;
+	});
 }
 
-std::vector<int>* Canvas::findMinima(Window* base, int k)
+/*
+Decomposes just 'region' of the image and writes the results into the same region of the outputs.
+The rest of the outputs is left alone. Any of the outputs can be nullptr, and 'residual' may be 'image'.
+
+The region is cropped out with a 'halo' of extra pixels on every side (as far as the image goes),
+the crop is decomposed, and then only the region itself is copied back.
+The halo covers the neighborhoods of the pixels at the edge of the region,
+and gives the solver room so the envelopes inside the region come out close to a whole image decomposition.
+The solve is global though, so the result is never exactly the same: a bigger halo is more accurate but slower.
+See defaultHalo for a reasonable trade-off.
+
+The time taken depends on the area of the region plus its halo, not on the size of the image.
+*/
+void Canvas::decomposeRegion(LabImage* image, SDL_Rect region, int k, bool fullColor, int halo, LabImage* residual, LabImage* detailLab, LabImage* detailLayer)
 {
-	int sideLength = k / 2;
-	std::vector<int>* minima = new std::vector<int>(base->imgRes, 0); //Initialize all entries to 0
-	ColorRGB rgb;
+	//Clip the region to the image, then grow it by the halo, also clipped to the image
+	int left = std::max(0, region.x);
+	int top = std::max(0, region.y);
+	int right = std::min(image->width, region.x + region.w);
+	int bottom = std::min(image->height, region.y + region.h);
+	if (right <= left || bottom <= top)
+		return;
 
-	for (int x = 0; x < base->imgWidth; x++)
+	int cropLeft = std::max(0, left - halo);
+	int cropTop = std::max(0, top - halo);
+	int cropRight = std::min(image->width, right + halo);
+	int cropBottom = std::min(image->height, bottom + halo);
+	int cropWidth = cropRight - cropLeft;
+	int cropHeight = cropBottom - cropTop;
+
+	LabImage* crop = nullptr;
+	LabImage* cropDetailLab = nullptr;
+	LabImage* cropDetailLayer = nullptr;
+	try
 	{
-		for (int y = 0; y < base->imgHeight; y++)
-		{
-			rgb = toRGB(base->img[base->XYtoIndex(x, y)]);
-			float centerLum = ntscLuminance(rgb.r, rgb.g, rgb.b);
-			int numSmaller = 0;
+		crop = new LabImage(cropWidth, cropHeight);
+		crop->copyRegion(image, cropLeft, cropTop, 0, 0, cropWidth, cropHeight);
+		if (detailLab != nullptr)
+			cropDetailLab = new LabImage(cropWidth, cropHeight);
+		if (detailLayer != nullptr)
+			cropDetailLayer = new LabImage(cropWidth, cropHeight);
 
-			for (int offsetX = -sideLength; offsetX <= sideLength; offsetX++)
-			{
-				for (int offsetY = -sideLength; offsetY <= sideLength; offsetY++)
-				{
-					if (x + offsetX >= 0
-						&& x + offsetX < base->imgWidth
-						&& y + offsetY >= 0
-						&& y + offsetY < base->imgHeight)
-					{
-						rgb = toRGB(base->img[base->XYtoIndex(x + offsetX, y + offsetY)]);
-						float luminance = ntscLuminance(rgb.r, rgb.g, rgb.b);
+		MatrixXf avg;
+		computeEnvelope(crop, k, fullColor, avg);
+		fillWithMultiDecompLayers(crop, crop, cropDetailLab, cropDetailLayer, &avg);
+	}
+	catch (...)
+	{
+		delete crop;
+		delete cropDetailLab;
+		delete cropDetailLayer;
+		throw;
+	}
 
-						if (luminance < centerLum)
-						{
-							numSmaller++;
-						}
-					}
-				}
-			}
+	//Only the region goes back, the halo is thrown away
+	int x = left - cropLeft;
+	int y = top - cropTop;
+	if (residual != nullptr)
+		residual->copyRegion(crop, x, y, left, top, right - left, bottom - top);
+	if (detailLab != nullptr)
+		detailLab->copyRegion(cropDetailLab, x, y, left, top, right - left, bottom - top);
+	if (detailLayer != nullptr)
+		detailLayer->copyRegion(cropDetailLayer, x, y, left, top, right - left, bottom - top);
 
-			if (numSmaller <= k)
-				minima->at(base->XYtoIndex(x, y)) = 1; //If center pixel is one of the k smallest luminances, flag it as a minimum
-		}
-	}
+	delete crop;
+	delete cropDetailLab;
+	delete cropDetailLayer;
+}
 
-	return minima;
+/*
+The halo decomposeRegion uses unless it's told otherwise: k * k pixels.
+Bigger neighborhoods mean fewer extrema, further apart, so the solve reaches further
+and the halo has to grow faster than k. Against a whole image decomposition of a noisy test image,
+k = 5 (25 pixels) was within 0.05 of L and k = 9 (81 pixels) within about 0.3.
+A quarter of that was off by several L, four times that was practically exact.
+*/
+int Canvas::defaultHalo(int k)
+{
+	return k * k;
 }
 
-std::vector<int>* Canvas::findMaxima(Window* base, int k)
+/*
+Returns the average of the minima and maxima envelopes: the coarse layer of one decomposition level.
+Column 0 is luminance in [0, 1]. Full color decompositions add the a and b channels as columns 1 and 2.
+*/
+MatrixXf Canvas::computeEnvelope(LabImage* image, int k, bool fullColor)
 {
-	int sideLength = k / 2;
-	std::vector<int>* maxima = new std::vector<int>(base->imgRes, 0); //Initialize all entries to 0
-	ColorRGB rgb;
+	MatrixXf envelope;
+	computeEnvelope(image, k, fullColor, envelope);
+	return envelope;
+}
 
-	for (int x = 0; x < base->imgWidth; x++)
-	{
-		for (int y = 0; y < base->imgHeight; y++)
-		{
-			rgb = toRGB(base->img[base->XYtoIndex(x, y)]);
-			float centerLum = ntscLuminance(rgb.r, rgb.g, rgb.b);
-			int numLarger = 0;
+/*
+Same, into 'envelope'. Everything is worked out in 'workspace', and then the average is swapped into 'envelope',
+so whatever it held before goes back to the workspace for the next decomposition instead of being freed.
+*/
+void Canvas::computeEnvelope(LabImage* image, int k, bool fullColor, MatrixXf& envelope)
+{
+	/*
+	Full color decompositions smooth the a and b channels with the same envelopes as luminance.
+	The interpolation matrix only depends on luminance and the extrema, so all channels share one solve setup.
+	*/
+	DecompositionWorkspace& work = workspace;
+	computeChannels(image, fullColor, work.channels);
 
-			for (int offsetX = -sideLength; offsetX <= sideLength; offsetX++)
-			{
-				for (int offsetY = -sideLength; offsetY <= sideLength; offsetY++)
-				{
-					if (x + offsetX >= 0
-						&& x + offsetX < base->imgWidth
-						&& y + offsetY >= 0
-						&& y + offsetY < base->imgHeight)
-					{
-						rgb = toRGB(base->img[base->XYtoIndex(x + offsetX, y + offsetY)]);
-						float luminance = ntscLuminance(rgb.r, rgb.g, rgb.b);
+	work.setup.clear(); //The maxima's solve reuses what it can from the minima's
+	findExtrema(image, k, &work.minima, &work.maxima);
+	interpolateExtrema(image, k, &work.minima, work.channels, work.lower, &work);
+	interpolateExtrema(image, k, &work.maxima, work.channels, work.upper, &work);
 
-						if (luminance > centerLum)
-						{
-							numLarger++;
-						}
-					}
-				}
-			}
+	work.lower = (work.lower + work.upper) / 2.0;
+	envelope.swap(work.lower);
+}
 
-			if (numLarger <= k)
-				maxima->at(base->XYtoIndex(x, y)) = 1; //If center pixel is one of the k largest luminances, flag it as a maximum
+long long DecompositionWorkspace::bytes() const
+{
+	long long total = 0;
+	for (const MatrixXf* matrix : { &channels, &lower, &upper, &solvedValues, &b })
+	{
+		total += matrix->size() * sizeof(float);
+	}
+	for (const VectorXf* vector : { &setup.luminance, &rhs, &result, &solver.r, &solver.r0, &solver.p, &solver.v, &solver.s, &solver.t, &solver.y, &solver.z })
+	{
+		total += vector->size() * sizeof(float);
+	}
+	for (const std::vector<int>* vector : { &minima, &maxima, &setup.fixed, &setup.newIndex, &solvedMap, &component, &starts, &pixels, &localIndex, &filled })
+	{
+		total += vector->capacity() * sizeof(int);
+	}
+	total += setup.variances.capacity() * sizeof(float) + sets.bytes();
+	if (setup.stencil != nullptr)
+	{
+		const StencilMatrix& stencil = *setup.stencil;
+		total += (stencil.rowScales.capacity() + stencil.diagonal.capacity()) * sizeof(float);
+		for (const std::vector<float>& plane : stencil.weights)
+		{
+			total += plane.capacity() * sizeof(float);
+		}
+		for (const std::vector<uint16_t>& plane : stencil.halfWeights)
+		{
+			total += plane.capacity() * sizeof(uint16_t);
 		}
 	}
+	return total;
+}
 
-	return maxima;
+void DecompositionWorkspace::release()
+{
+	for (MatrixXf* matrix : { &channels, &lower, &upper, &solvedValues, &b })
+	{
+		matrix->resize(0, 0);
+	}
+	for (VectorXf* vector : { &setup.luminance, &rhs, &result, &solver.r, &solver.r0, &solver.p, &solver.v, &solver.s, &solver.t, &solver.y, &solver.z })
+	{
+		vector->resize(0);
+	}
+	for (std::vector<int>* vector : { &minima, &maxima, &setup.fixed, &setup.newIndex, &solvedMap, &component, &starts, &pixels, &localIndex, &filled })
+	{
+		std::vector<int>().swap(*vector);
+	}
+	std::vector<float>().swap(setup.variances);
+	sets = DisjointSets();
+	delete setup.stencil;
+	setup.stencil = nullptr;
+	setup.clear();
+}
+
+//How many pixels make up a neighborhood with these options
+static long long neighborhoodTaps(int k, const InterpolationOptions& options)
+{
+	long long offsets = Canvas::neighborhoodOffsets(k, options.dilatedTaps).size();
+	return offsets * offsets;
 }
 
 /*
-Interpolates luminance values across the image,
-holding local extrema constant and modifying neighboring values to smoothly transition between them.
-@params
-r			red channel
-g			green channel
-b			blue channel
-width		width of the image in pixels
-height		height of the image in pixels
-k			the length of each edge of the neighborhood. The neighborhood ends up being k * k pixels centered on one central pixel.
-extremaMap	a vector containing flags for each pixel. 1 means the corresponding pixel is an extrema, 0 means it's not.
+Whether computeEnvelope can number everything it has to for a width * height image with 'options'.
+Pixels are numbered with int everywhere, and the non-zeros of the sparse matrices with SparseIndex,
+so unless that's 64-bit, an exact solve through one runs out at about 2^31 / (k * k) pixels.
+The stencil only has pixel numbers, and its weights are addressed with size_t.
+*/
+static bool indexable(int width, int height, int k, const InterpolationOptions& options)
+{
+	long long pixels = (long long)width * height;
+	if (pixels > std::numeric_limits<int>::max())
+		return false;
+
+	bool sparse = options.format == MATRIX_SPARSE || options.ordering != ORDER_ROW_MAJOR || (options.splitComponents && !options.refine);
+	if (options.method != INTERPOLATE_EXACT || !sparse)
+		return true;
+	return pixels * neighborhoodTaps(k, options) <= std::numeric_limits<SparseIndex>::max();
+}
+
+/*
+How many bytes computeEnvelope allocates at most for a width * height image with 'options', starting from an empty workspace.
+It adds up what each stage keeps per pixel, with the parts that depend on the image at their worst:
+the sparse matrix and the hierarchical basis as if there were no extrema,
+and the small systems of solveComponents as if every free pixel were in one being solved at the same time.
+Those are in double and took about 22 bytes per non-zero, so they can be several times the rest of the solve.
+They're rarely anywhere near that, which is why planDecomposition tries turning splitComponents off first.
+Without splitComponents, the bundled images at k = 5 allocated within 0.5% of it with the stencil (which is what planDecomposition's 1% spare is for),
+and half of it for the sparse matrix, which has fewer non-zeros the more extrema there are.
 */
-VectorXf Canvas::interpolateExtrema(Window* src, int k, std::vector<int>* extremaMap)
+long long Canvas::estimateEnvelopeBytes(int width, int height, int k, bool fullColor, const InterpolationOptions& options)
 {
-	//res is the total number of pixels in the imag
-	float* luminance = new float[src->imgRes];
-	for (int i = 0; i < src->imgRes; i++)
+	long long taps = neighborhoodTaps(k, options);
+	long long channels = fullColor ? 3 : 1;
+	long long sparseEntry = sizeof(float) + sizeof(SparseIndex); //A value and its index
+
+	long long perPixel = 2 * sizeof(int) + 3 * channels * sizeof(float); //The extrema maps, the channels and both envelopes
+	if (options.method == INTERPOLATE_APPROXIMATE)
 	{
-		/*
-		MatLab has an rgb2ntsc functions that converts
-		rgb to Y, I, Q channels.
-		We took their luminance calculation,
-		which is from the Y channel.
+		perPixel += (6 + channels) * sizeof(float); //The filter's planes and its result
+	}
+	else if (options.method == INTERPOLATE_RELAXED)
+	{
+		perPixel += (1 + channels) * sizeof(float); //Luminance and the values
+	}
+	else
+	{
+		perPixel += (1 + channels) * sizeof(float); //Luminance and b
+		if (options.kernel != KERNEL_REFERENCE)
+			perPixel += sizeof(float); //The variances
 
-		This function expects values in the range [0, 1].
-		*/
-		ColorRGB rgb = toRGB(src->img[i]);
-		luminance[i] = ntscLuminance(rgb.r / 255.0f, rgb.g / 255.0f, rgb.b / 255.0f);
+		if (options.splitComponents && !options.refine)
+			perPixel += 6 * sizeof(int) + channels * sizeof(float) + (16 + 2 * sizeof(SparseIndex)) * taps; //Union-find, bookkeeping, what's solved and the small systems
+
+		bool hierarchical = options.preconditioner == PRECONDITION_HIERARCHICAL && options.ordering == ORDER_ROW_MAJOR;
+		if (options.format == MATRIX_STENCIL && options.ordering == ORDER_ROW_MAJOR)
+		{
+			perPixel += taps * sizeof(float) + sizeof(int); //The weights, and which extrema they're for
+			if (options.weights == WEIGHTS_HALF)
+				perPixel += sizeof(uint16_t) + sizeof(double) + 2 * sizeof(float); //A plane of fp16 weights and the rounding errors while they're compressed, the scales and the diagonal
+		}
+		else
+		{
+			perPixel += 2 * taps * sparseEntry + 2 * sizeof(SparseIndex); //Reserved a column at a time, then a copy for the solver
+			if (options.ordering != ORDER_ROW_MAJOR)
+				perPixel += taps * sparseEntry + 3 * sizeof(int); //The renumbered copy and the ordering
+			if (hierarchical)
+				perPixel += taps * sparseEntry + sizeof(int); //The row major copy the basis is built from
+		}
+		if (hierarchical)
+			perPixel += 16 * taps + 32; //The basis, and the coarsened matrices matchDiagonal works through (the most the bundled images took)
+
+		if (options.solver == SOLVER_PARALLEL)
+		{
+			perPixel += 8 * sizeof(float); //rhs, result and BicgstabVectors
+			if (hierarchical)
+				perPixel += 2 * sizeof(float);
+			if (options.refine)
+				perPixel += 3 * sizeof(double);
+		}
+		else
+		{
+			perPixel += 10 * channels * sizeof(float); //Each channel's solver, all at once
+		}
 	}
+	return perPixel * width * height;
+}
 
-	int sideLength = k / 2; //We'll loop from -sideLength to sideLength to handle all pixels surrounding the current center pixel
+/*
+Works out how to decompose a width * height image (or just 'region' of it, if it's not nullptr) with k * k neighborhoods
+in memoryBudget bytes, 'resident' of which the caller already holds or will while it runs. In order of preference:
+1. In core, with the interpolation options as they are.
+2. In core without splitComponents, whose systems are most of the worst case (see estimateEnvelopeBytes).
+   Images too big to number with SparseIndex (see indexable) go on to the next step the same way.
+3. Tiled, with the biggest tiles that fit, as long as they're at least PREFERRED_TILE_HALOS halos wide.
+   Tiles are solved exactly, and at k = 5 come out within about 1 of L of a whole image decomposition near their seams
+   and the same elsewhere (see defaultHalo), which is about as close as the relaxed envelopes, and sooner.
+4. In core with INTERPOLATE_RELAXED, which needs no matrix: about 28 bytes a pixel more than the image in gray, 52 in color.
+5. Tiled with smaller tiles, down to MIN_TILE_SIZE or a halo.
+Tiles are decomposed from a copy of the image, since each one's halo reaches into the tiles already written back.
+Throws DecompositionTooLarge if none of them fit.
+*/
+DecompositionPlan Canvas::planDecomposition(int width, int height, const SDL_Rect* region, int k, bool fullColor, long long resident)
+{
+	int halo = defaultHalo(k);
+	long long labPixel = LabImage::PIXEL_BYTES;
+	long long available = memoryBudget - memoryBudget / 100; //The estimates can be a little under, see estimateEnvelopeBytes
 
-	SparseMatrix<float> A(src->imgRes, src->imgRes); //'A' has one coordinate pair per pixel.
-	/*
-	Now we reserve room for k*k non-zero entries per column.
-	This step is crucial to making the matrix insertions reasonably fast.
-	*/
-	A.reserve(VectorXd::Constant(src->imgRes, k * k));
+	//What's decomposed at once: the whole image, or the region with its halo cropped out along with its layers, like decomposeRegion does
+	int left = 0, top = 0, right = width, bottom = height;
+	int areaWidth = width;
+	int areaHeight = height;
+	long long areaResident = resident;
+	if (region != nullptr)
+	{
+		left = std::max(0, region->x);
+		top = std::max(0, region->y);
+		right = std::max(left, std::min(width, region->x + region->w));
+		bottom = std::max(top, std::min(height, region->y + region->h));
+		areaWidth = std::min(width, right + halo) - std::max(0, left - halo);
+		areaHeight = std::min(height, bottom + halo) - std::max(0, top - halo);
+		areaResident += 3 * labPixel * areaWidth * areaHeight;
+	}
 
-	std::vector<int> rows;
-	rows.reserve(k * k);
-	std::vector<int> cols;
-	cols.reserve(k * k);
-	std::vector<float> workingValues; //Will hold the luminance of neighboring pixels
-	workingValues.reserve(k * k);
+	DecompositionPlan plan;
+	plan.options = interpolation;
+	plan.peakBytes = areaResident + estimateEnvelopeBytes(areaWidth, areaHeight, k, fullColor, plan.options);
+	if (plan.peakBytes <= available && indexable(areaWidth, areaHeight, k, plan.options))
+		return plan;
 
-	/*
-	Outer loop goes through y indices,
-	Inner loop goes through x.
-	This is because the sparse matrix needs to be set up in THIS ORDER EXACTLY
-	Don't mess with me.
-	:P
-	*/
-	for (int y = 0; y < src->imgHeight; y++)
+	if (plan.options.splitComponents)
+	{
+		plan.options.splitComponents = false; //Only there to go faster
+		plan.peakBytes = areaResident + estimateEnvelopeBytes(areaWidth, areaHeight, k, fullColor, plan.options);
+		if (plan.peakBytes <= available && indexable(areaWidth, areaHeight, k, plan.options))
+			return plan;
+	}
+
+	//A tile takes the copy of the image, its crop and the crop's 2 layers, and its envelope, the same for every tile
+	auto tiledBytes = [&](int tileSize)
+	{
+		int cropWidth = std::min(width, tileSize + 2 * halo);
+		int cropHeight = std::min(height, tileSize + 2 * halo);
+		return resident + labPixel * width * height + 3 * labPixel * cropWidth * cropHeight
+			+ estimateEnvelopeBytes(cropWidth, cropHeight, k, fullColor, plan.options);
+	};
+	auto tileFits = [&](int tileSize)
+	{
+		return tiledBytes(tileSize) <= available
+			&& indexable(std::min(width, tileSize + 2 * halo), std::min(height, tileSize + 2 * halo), k, plan.options);
+	};
+	int smallest = std::max(MIN_TILE_SIZE, halo);
+	int biggest = std::max(right - left, bottom - top);
+	int tileSize = 0;
+	if (smallest <= biggest && tileFits(smallest))
 	{
-		for (int x = 0; x < src->imgWidth; x++)
+		//The biggest tiles that fit. Bigger tiles never take less, or fewer non-zeros.
+		int low = smallest;
+		int high = biggest;
+		while (low < high)
 		{
-			if (!extremaMap->at(src->XYtoIndex(x, y)))	//Only interpolate value if it's not an extrema.
-			{										//This means extrema will always keep their luminance values. In theory.
-				for (int offsetX = -sideLength; offsetX <= sideLength; offsetX++)
-				{
-					for (int offsetY = -sideLength; offsetY <= sideLength; offsetY++)
-					{
-						if (x + offsetX >= 0
-							&& x + offsetX < src->imgWidth
-							&& y + offsetY >= 0
-							&& y + offsetY < src->imgHeight)
-						{
-							if (offsetX != 0 || offsetY != 0)
-							{
-								rows.push_back(src->XYtoIndex(x, y)); //Index of center pixel
-								cols.push_back(src->XYtoIndex(x + offsetX, y + offsetY)); //Index of current neighbor
-								workingValues.push_back(luminance[src->XYtoIndex(x + offsetX, y + offsetY)]); //Luminance of current neighbor
-							}
-						}
-					}
-				}
+			int middle = low + (high - low + 1) / 2;
+			if (tileFits(middle))
+				low = middle;
+			else
+				high = middle - 1;
+		}
+		tileSize = low;
+	}
 
-				float centerLuminance = luminance[src->XYtoIndex(x, y)];
+	DecompositionPlan tiled = plan;
+	tiled.strategy = STRATEGY_TILED;
+	tiled.tileSize = tileSize;
+	tiled.peakBytes = tiledBytes(tileSize);
+	if (tileSize >= PREFERRED_TILE_HALOS * halo)
+		return tiled;
 
-				/*
-				'neighbors' excludes the center pixel itself.
-				For most calculations that's what we want,
-				but for avgDeviation we need the avg to be calculated including the center pixel.
-				*/
-				workingValues.push_back(centerLuminance);
-				float avgLuminance = avgFloats(workingValues);
+	DecompositionPlan relaxed = plan;
+	relaxed.strategy = STRATEGY_MATRIX_FREE;
+	relaxed.options.method = INTERPOLATE_RELAXED;
+	relaxed.peakBytes = areaResident + estimateEnvelopeBytes(areaWidth, areaHeight, k, fullColor, relaxed.options);
+	if (plan.options.method == INTERPOLATE_EXACT && relaxed.peakBytes <= available && indexable(areaWidth, areaHeight, k, relaxed.options))
+		return relaxed;
 
-				std::vector<float> avgDeviation = std::vector<float>(workingValues.size());
-				for (int i = 0; i < workingValues.size(); i++)
-				{
-					avgDeviation[i] = pow(workingValues[i] - avgLuminance, 2);
-				}
-				float csig = avgFloats(avgDeviation);
+	if (tileSize > 0)
+		return tiled;
 
-				workingValues.pop_back(); //Remove center pixel after calculating avg
+	long long needed = std::min(relaxed.peakBytes, tiledBytes(std::min(smallest, std::max(biggest, 1))));
+	char message[256];
+	snprintf(message, sizeof(message), "Decomposing %d x %d pixels with k = %d needs at least %.1f MB, but the memory budget is %.1f MB",
+		right - left, bottom - top, k, needed / 1048576.0, memoryBudget / 1048576.0);
+	throw DecompositionTooLarge(message);
+}
 
-				csig *= 0.6;
-				std::vector<float> deviationFromCenter = std::vector<float>(workingValues.size());
-				for (int i = 0; i < workingValues.size(); i++)
-				{
-					deviationFromCenter[i] = pow(centerLuminance - workingValues[i], 2);
-				}
-				float smallestDeviation = minFloats(deviationFromCenter);
-				if (csig < -smallestDeviation / log(0.01f))
-					csig = -smallestDeviation / log(0.01f);
-				if (csig < 0.000002)
-					csig = 0.000002f;
+//Says what planDecomposition had to do to fit in the budget, if anything
+void Canvas::printPlan(const DecompositionPlan& plan, int k)
+{
+	long long megabytes = plan.peakBytes >> 20;
+	long long budget = memoryBudget >> 20;
+	if (plan.strategy == STRATEGY_TILED)
+		printf("k = %d: decomposing in tiles of %d x %d to fit in the memory budget (about %lld of %lld MB)\n", k, plan.tileSize, plan.tileSize, megabytes, budget);
+	else if (plan.strategy == STRATEGY_MATRIX_FREE)
+		printf("k = %d: using relaxed envelopes, which don't need a matrix, to fit in the memory budget (about %lld of %lld MB)\n", k, megabytes, budget);
+	else if (plan.options.splitComponents != interpolation.splitComponents)
+		printf("k = %d: solving the whole image at once to fit in the memory budget (about %lld of %lld MB)\n", k, megabytes, budget);
+}
 
-				for (int i = 0; i < workingValues.size(); i++)
-				{
-					workingValues[i] = exp(-pow(centerLuminance - workingValues[i], 2.0f) / csig);
-				}
-				float sum = sumFloats(workingValues);
-				for (int i = 0; i < workingValues.size(); i++)
-				{
-					workingValues[i] /= sum;
-				}
+/*
+Decomposes the image, or 'region' of it, the way planDecomposition said to,
+into the same 3 outputs as decomposeRegion. 'residual' can't be nullptr but may be 'image'.
+The workspace is emptied first if what it holds from the last decomposition wouldn't leave room for this one.
+*/
+void Canvas::decomposePlanned(LabImage* image, const SDL_Rect* region, int k, bool fullColor, const DecompositionPlan& plan, LabImage* residual, LabImage* detailLab, LabImage* detailLayer)
+{
+	if (workspace.bytes() + plan.peakBytes > memoryBudget)
+		workspace.release();
 
-				//Now add all the neighbors to matrix A with the weights we calculated
-				for (int i = 0; i < workingValues.size(); i++)
+	InterpolationOptions options = interpolation;
+	interpolation = plan.options;
+	LabImage* source = nullptr;
+	try
+	{
+		SDL_Rect area = region != nullptr ? *region : SDL_Rect{ 0, 0, image->width, image->height };
+		if (plan.strategy != STRATEGY_TILED && region != nullptr)
+		{
+			decomposeRegion(image, area, k, fullColor, defaultHalo(k), residual, detailLab, detailLayer);
+		}
+		else if (plan.strategy != STRATEGY_TILED)
+		{
+			MatrixXf avg;
+			computeEnvelope(image, k, fullColor, avg);
+			fillWithMultiDecompLayers(image, residual, detailLab, detailLayer, &avg);
+		}
+		else
+		{
+			int halo = defaultHalo(k);
+			std::vector<SDL_Rect> tiles;
+			for (int y = area.y; y < area.y + area.h; y += plan.tileSize)
+			{
+				for (int x = area.x; x < area.x + area.w; x += plan.tileSize)
 				{
-					A.insert(rows[i], cols[i]) = -workingValues[i]; //Negate the values before storing them
+					tiles.push_back({ x, y, std::min(plan.tileSize, area.x + area.w - x), std::min(plan.tileSize, area.y + area.h - y) });
 				}
 			}
 
-			//Now add center pixel with weight=1
-			A.insert(src->XYtoIndex(x, y), src->XYtoIndex(x, y)) = 1.0f;
+			/*
+			The tile with the biggest crop goes first, so the workspace grows to its full size right away.
+			Growing it later would have the old buffers and the new ones allocated at the same time.
+			*/
+			auto cropArea = [&](const SDL_Rect& tile)
+			{
+				return (long long)(std::min(image->width, tile.x + tile.w + halo) - std::max(0, tile.x - halo))
+					* (std::min(image->height, tile.y + tile.h + halo) - std::max(0, tile.y - halo));
+			};
+			std::iter_swap(tiles.begin(), std::max_element(tiles.begin(), tiles.end(), [&](const SDL_Rect& a, const SDL_Rect& b) { return cropArea(a) < cropArea(b); }));
 
-			rows.clear();
-			cols.clear();
-			workingValues.clear();
+			source = new LabImage(image->width, image->height);
+			source->copyFrom(image);
+			for (const SDL_Rect& tile : tiles)
+			{
+				decomposeRegion(source, tile, k, fullColor, halo, residual, detailLab, detailLayer);
+			}
 		}
 	}
+	catch (...)
+	{
+		delete source;
+		interpolation = options;
+		throw;
+	}
+	delete source;
+	interpolation = options;
+}
+
+/*
+Adds the overlay's detail onto the base window, scaled by detailGain.
+Detail windows made by runMultiDecomp keep their unpacked float layer, which already holds any chroma detail.
+For other windows we fall back to undoing the display packing of fillWithMultiDecompDetail.
+*/
+void Canvas::reconstructFromDecomps(Window* base, Window* overlay, bool fullColor, float detailGain)
+{
+	LabImage* lab = base->lab;
+
+	if (overlay->layer != nullptr)
+	{
+		std::vector<LabImage*> layers = { lab, overlay->layer };
+		std::vector<float> gains = { 1.0f, detailGain };
+		recompose(lab, layers, gains);
+		return;
+	}
 
-	VectorXf b(src->imgRes);
-	for (int i = 0; i < b.size(); i++) //We want the solver to keep extrema values the same. Only non-extrema are interpolated.
+	LabImage* detail = overlay->lab;
+	for (int i = 0; i < lab->res; i++)
 	{
-		if (extremaMap->at(i) != 0)
+		lab->l[i] += (detail->l[i] * 2.0f - 100.0f) * detailGain;
+		if (fullColor) //Color detail layers store a and b halved, see fillWithMultiDecompDetail
 		{
-			b[i] = luminance[i];
+			lab->a[i] += detail->a[i] * 2.0f * detailGain;
+			lab->b[i] += detail->b[i] * 2.0f * detailGain;
 		}
-		else
+	}
+	lab->updateLuminance();
+}
+
+/*
+output = gains[0] * layers[0] + gains[1] * layers[1] + ...
+Every plane is summed (alpha is left alone), so a layer can be a full image like a coarse residual
+or a signed detail layer. 'output' may be one of the layers.
+Rows are split between threads and each block of a row is summed with Eigen's vectorized array operations.
+Nothing is converted to packed pixels here; call updateTexture on the window once the result is ready.
+*/
+void Canvas::recompose(LabImage* output, std::vector<LabImage*>& layers, std::vector<float>& gains)
+{
+	parallelFor(0, output->height, [&](int firstRow, int lastRow)
+	{
+		ArrayXf l(output->width), a(output->width), b(output->width);
+		for (int y = firstRow; y < lastRow; y++)
 		{
-			b[i] = 0.0f;
+			recomposeRow(layers, gains, y, l.data(), a.data(), b.data());
+			int row = output->XYtoIndex(0, y);
+			Map<ArrayXf>(output->l + row, output->width) = l;
+			Map<ArrayXf>(output->a + row, output->width) = a;
+			Map<ArrayXf>(output->b + row, output->width) = b;
 		}
-	}
+	});
+	output->updateLuminance();
+}
 
-	delete[] luminance; //The sparse matrix is a memory hog. To help not crash the program, I delete everything I can as soon as I can.
+/*
+Same as recompose, but each row goes straight to packed pixels instead of being stored as LAB.
+That's one pass over the layers and one over the output, which is what makes the enhancement slider interactive.
+'pitch' is the length of a row of 'pixels' in bytes, as SDL_LockTexture reports it.
+*/
+void Canvas::recomposeToPixels(std::vector<LabImage*>& layers, std::vector<float>& gains, Uint32* pixels, int pitch)
+{
+	int width = layers[0]->width;
+	parallelFor(0, layers[0]->height, [&](int firstRow, int lastRow)
+	{
+		ArrayXf l(width), a(width), b(width);
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			recomposeRow(layers, gains, y, l.data(), a.data(), b.data());
+			rowFromLAB(l.data(), a.data(), b.data(), (Uint32*)((Uint8*)pixels + (size_t)y * pitch), width);
+		}
+	});
+}
 
-	/*
-	The Eigen framework has a variety of sparse matrix solvers available.
-	Only 2 of the several I tried gave the results we wanted:
-	BiCGSTAB and SparseLU.
-	I chose BiCGSTAB because it was 3 times faster.
-	*/
-	BiCGSTAB<SparseMatrix<float>> solver;
-	solver.compute(A);
-	VectorXf x = solver.solve(b);
+//Sums row y of every layer, scaled by its gain, into l, a and b. Eigen vectorizes the sums.
+void Canvas::recomposeRow(std::vector<LabImage*>& layers, std::vector<float>& gains, int y, float* l, float* a, float* b)
+{
+	int width = layers[0]->width;
+	int row = layers[0]->XYtoIndex(0, y);
+	Map<ArrayXf> sumL(l, width), sumA(a, width), sumB(b, width);
 
-	return x;
+	sumL = Map<ArrayXf>(layers[0]->l + row, width) * gains[0];
+	sumA = Map<ArrayXf>(layers[0]->a + row, width) * gains[0];
+	sumB = Map<ArrayXf>(layers[0]->b + row, width) * gains[0];
+	for (int j = 1; j < layers.size(); j++)
+	{
+		sumL += Map<ArrayXf>(layers[j]->l + row, width) * gains[j];
+		sumA += Map<ArrayXf>(layers[j]->a + row, width) * gains[j];
+		sumB += Map<ArrayXf>(layers[j]->b + row, width) * gains[j];
+	}
 }
 
-void Canvas::fillWithMultiDecompResidual(Window* window, VectorXf* multiDecompValues)
+/*
+Decomposes the window's image into 'levels' detail layers plus a coarse layer and keeps them all in memory.
+Each level doubles the neighborhood size of the last one.
+After that, changing a gain in enhanceGains and calling showEnhancement recomposes the window
+without running any more decompositions.
+Throws DecompositionTooLarge if a level won't fit in memoryBudget.
+*/
+void Canvas::startEnhancing(Window* window, int k, int levels, bool fullColor)
 {
-	for (int i = 0; i < window->imgRes; i++)
-	{
-		float avg = (*multiDecompValues)[i];
-		avg *= 100.0f; //From [0.0, 1.0] to [0.0, 100.0]
-		avg = std::min(100.0f, std::max(0.0f, avg)); //Clamp to [0.0, 100.0]
+	stopEnhancing();
 
-		ColorLAB lab = toLAB(window->img[i]);
-		ColorLAB lab2 = ColorLAB(avg, lab.a, lab.b);
-		ColorRGB rgb = toRGB(lab2);
-		window->img[i] = toSDL(rgb);
-	}
+	std::vector<DecompositionPlan> plans = planEnhancement(window->imgWidth, window->imgHeight, k, levels, fullColor);
+	computeEnhanceLayers(window->lab, k, fullColor, plans, enhanceLayers);
+	enhanceGains.assign(enhanceLayers.size(), 1.0f);
+	enhanceWindow = window;
 }
 
-void Canvas::fillWithMultiDecompDetail(Window* window, VectorXf* multiDecompValues)
+/*
+Plans every level of startEnhancing up front, so one that doesn't fit in memoryBudget is turned down before any work is done.
+Each level holds the layers before it, the coarse layer, its own detail layer and the image it started from.
+*/
+std::vector<DecompositionPlan> Canvas::planEnhancement(int width, int height, int k, int levels, bool fullColor)
 {
-	for (int i = 0; i < window->imgRes; i++)
+	std::vector<DecompositionPlan> plans;
+	int levelK = k;
+	for (int level = 0; level < levels; level++)
 	{
-		float avg = (*multiDecompValues)[i];
-		avg *= 100.0f; //From [0.0, 1.0] to [0.0, 100.0]
-		avg = std::min(100.0f, std::max(0.0f, avg)); //Clamp to [0.0, 100.0]
-
-		ColorLAB lab = toLAB(window->img[i]);
-		float l = lab.l;
-		l = l - avg; //Now in [-100.0, 100.0]
-		l = (l + 100.0) / 2.0; //Now in [0.0, 100.0]
-		ColorRGB rgb = toRGB(ColorLAB(l, lab.a, lab.b));
-		window->img[i] = toSDL(rgb);
+		long long resident = (long long)width * height * LabImage::PIXEL_BYTES * (level + 3);
+		plans.push_back(planDecomposition(width, height, nullptr, levelK, fullColor, resident));
+		levelK = (levelK - 1) * 2 + 1;
 	}
+	return plans;
 }
 
-void Canvas::fillWithMaximaOnly(Window* window, int k)
+/*
+Appends the coarse layer and then a detail layer per plan (see planEnhancement) of 'image' to 'layers', see startEnhancing.
+If the decomposition is cancelled or fails, anything already appended is deleted again.
+*/
+void Canvas::computeEnhanceLayers(LabImage* image, int k, bool fullColor, const std::vector<DecompositionPlan>& plans, std::vector<LabImage*>& layers)
 {
-	auto maxima = findMaxima(window, k);
-	for (int i = 0; i < maxima->size(); i++)
+	size_t first = layers.size();
+	try
 	{
-		if (!maxima->at(i))
+		layers.reserve(first + plans.size() + 1); //So pushing a layer can't fail once it's allocated
+		LabImage* coarse = new LabImage(image->width, image->height);
+		layers.push_back(coarse);
+		coarse->copyFrom(image);
+
+		int levelK = k;
+		for (const DecompositionPlan& plan : plans)
 		{
-			window->img[i] = toSDL(ColorRGB(0, 0, 0));
+			LabImage* detail = new LabImage(image->width, image->height);
+			layers.push_back(detail);
+			decomposePlanned(coarse, nullptr, levelK, fullColor, plan, coarse, nullptr, detail);
+			levelK = (levelK - 1) * 2 + 1;
 		}
 	}
-
-	delete maxima;
+	catch (...)
+	{
+		for (size_t i = first; i < layers.size(); i++)
+		{
+			delete layers[i];
+		}
+		layers.resize(first);
+		throw;
+	}
 }
 
-void Canvas::fillWithMinimaOnly(Window* window, int k)
+//Same as startEnhancing, but the layers are computed on a worker thread. enhanceWindow is set once they're ready.
+void Canvas::startEnhancingInBackground(Window* window, int k, int levels, bool fullColor)
 {
-	auto minima = findMinima(window, k);
-	for (int i = 0; i < minima->size(); i++)
+	stopEnhancing();
+
+	std::vector<DecompositionPlan> plans = planEnhancement(window->imgWidth, window->imgHeight, k, levels, fullColor);
+	int levelK = k;
+	for (const DecompositionPlan& plan : plans)
 	{
-		if (!minima->at(i))
-		{
-			window->img[i] = toSDL(ColorRGB(0, 0, 0));
-		}
+		printPlan(plan, levelK);
+		levelK = (levelK - 1) * 2 + 1;
 	}
 
-	delete minima;
-}
\ No newline at end of file
+	LabImage* image = new LabImage(window->imgWidth, window->imgHeight);
+	image->copyFrom(window->lab);
+	std::vector<LabImage*>* layers = new std::vector<LabImage*>();
+
+	runInBackground([=]()
+	{
+		computeEnhanceLayers(image, k, fullColor, plans, *layers);
+	},
+	[=](bool completed)
+	{
+		if (completed && hasWindow(window))
+		{
+			enhanceLayers = *layers;
+			enhanceGains.assign(enhanceLayers.size(), 1.0f);
+			enhanceWindow = window;
+		}
+		else
+		{
+			for (auto layer : *layers)
+			{
+				delete layer;
+			}
+		}
+		delete layers;
+		delete image;
+	});
+}
+
+/*
+Leaves enhancement mode.
+keepResult: bake the current gains into the window's image. Otherwise the window goes back to how it started.
+*/
+void Canvas::stopEnhancing(bool keepResult)
+{
+	if (enhanceWindow != nullptr)
+	{
+		if (!keepResult)
+		{
+			enhanceGains.assign(enhanceLayers.size(), 1.0f);
+		}
+		recompose(enhanceWindow->lab, enhanceLayers, enhanceGains);
+		enhanceWindow->updateTexture();
+		enhanceWindow = nullptr;
+	}
+
+	for (auto layer : enhanceLayers)
+	{
+		delete layer;
+	}
+	enhanceLayers.clear();
+	enhanceGains.clear();
+}
+
+//Recomposes the enhancement layers with the current gains directly into the window's texture
+void Canvas::showEnhancement()
+{
+	if (enhanceWindow == nullptr)
+		return;
+
+	int pitch;
+	Uint32* pixels = enhanceWindow->lockTexture(pitch);
+	if (pixels != nullptr)
+	{
+		recomposeToPixels(enhanceLayers, enhanceGains, pixels, pitch);
+		enhanceWindow->unlockTexture();
+	}
+	enhanceWindow->render();
+}
+
+/*
+The offsets, along each axis, of the pixels that make up a k * k neighborhood.
+Normally that's every offset from -k / 2 to k / 2.
+With interpolation.dilatedTaps set and k bigger than it, it's dilatedTaps offsets spread out
+(a trous, "with holes") so they still reach the edge of the neighborhood and no further, e.g. k = 21 with 5 taps: -10, -5, 0, 5, 10.
+Both the extrema test and the matrix weights use these, so they always agree on what the neighborhood is.
+*/
+std::vector<int> Canvas::neighborhoodOffsets(int k)
+{
+	return neighborhoodOffsets(k, interpolation.dilatedTaps);
+}
+
+/*
+Same, for any dilatedTaps.
+Tap i of the taps on each side is i / (taps / 2) of the way to the edge, rounded to the nearest pixel.
+When k / 2 isn't a multiple of taps / 2 they aren't quite evenly spaced: k = 7 with 5 taps is -3, -2, 0, 2, 3.
+k / 2 is at least taps / 2 whenever k is bigger than taps, so no two taps round to the same pixel.
+*/
+std::vector<int> Canvas::neighborhoodOffsets(int k, int dilatedTaps)
+{
+	int sideLength = k / 2;
+	std::vector<int> offsets;
+	if (dilatedTaps > 0 && k > dilatedTaps)
+	{
+		int tapSide = std::max(1, dilatedTaps / 2);
+		for (int tap = -tapSide; tap <= tapSide; tap++)
+		{
+			offsets.push_back((int)std::lround((double)tap * sideLength / tapSide)); //Rounds halves away from 0, so it stays symmetric
+		}
+	}
+	else
+	{
+		for (int offset = -sideLength; offset <= sideLength; offset++)
+		{
+			offsets.push_back(offset);
+		}
+	}
+	return offsets;
+}
+
+/*
+A pixel is a minimum if at most this many pixels of its neighborhood are darker (a maximum: brighter).
+That's k out of the k * k pixels of a full neighborhood.
+A dilated neighborhood has fewer pixels, so the count is scaled down to keep the same proportion.
+*/
+int Canvas::extremaRank(int k)
+{
+	int samples = (int)neighborhoodOffsets(k).size();
+	samples *= samples;
+	return std::max(1, (int)((long long)k * samples / (k * k)));
+}
+
+std::vector<int>* Canvas::findMinima(LabImage* base, int k)
+{
+	std::vector<int>* minima = new std::vector<int>();
+	try
+	{
+		findMinima(base, k, *minima);
+	}
+	catch (...)
+	{
+		delete minima;
+		throw;
+	}
+	return minima;
+}
+
+std::vector<int>* Canvas::findMaxima(LabImage* base, int k)
+{
+	std::vector<int>* maxima = new std::vector<int>();
+	try
+	{
+		findMaxima(base, k, *maxima);
+	}
+	catch (...)
+	{
+		delete maxima;
+		throw;
+	}
+	return maxima;
+}
+
+//Same as above, into a vector that's already there
+void Canvas::findMinima(LabImage* base, int k, std::vector<int>& minima)
+{
+	findExtrema(base, k, &minima, nullptr);
+}
+
+void Canvas::findMaxima(LabImage* base, int k, std::vector<int>& maxima)
+{
+	findExtrema(base, k, nullptr, &maxima);
+}
+
+/*
+Both at once, in one pass over the image (see Eisel::streamExtrema). Either can be nullptr.
+If the center pixel is one of the k smallest luminances in its neighborhood, it's flagged as a minimum, and one of the k largest, a maximum.
+*/
+void Canvas::findExtrema(LabImage* base, int k, std::vector<int>* minima, std::vector<int>* maxima)
+{
+	int width = base->width;
+	FlagSink minimaSink, maximaSink;
+	if (minima != nullptr)
+	{
+		minima->resize(base->res);
+		minimaSink = [=](int y, const int* flags) { std::copy(flags, flags + width, minima->data() + (size_t)y * width); };
+	}
+	if (maxima != nullptr)
+	{
+		maxima->resize(base->res);
+		maximaSink = [=](int y, const int* flags) { std::copy(flags, flags + width, maxima->data() + (size_t)y * width); };
+	}
+
+	streamExtrema(width, base->height, neighborhoodOffsets(k), extremaRank(k), [&](int y, float* row)
+	{
+		checkProgress("Finding extrema", y, base->height);
+		std::copy(base->luminance + (size_t)y * width, base->luminance + (size_t)(y + 1) * width, row);
+	}, minimaSink, maximaSink);
+}
+
+VectorXf Canvas::computeLuminance(LabImage* src)
+{
+	VectorXf luminance;
+	computeLuminance(src, luminance);
+	return luminance;
+}
+
+void Canvas::computeLuminance(LabImage* src, VectorXf& luminance)
+{
+	/*
+	MatLab has an rgb2ntsc functions that converts
+	rgb to Y, I, Q channels.
+	We took their luminance calculation,
+	which is from the Y channel.
+
+	Every LabImage keeps it next to L, a and b, in [0, 1].
+	*/
+	luminance = Map<VectorXf>(src->luminance, src->res);
+}
+
+/*
+Returns one column per channel: luminance in [0, 1], then the LAB a and b channels.
+These are the right-hand sides of a full color decomposition.
+*/
+MatrixXf Canvas::computeColorChannels(LabImage* src)
+{
+	MatrixXf channels;
+	computeChannels(src, true, channels);
+	return channels;
+}
+
+//What a decomposition interpolates: the columns of computeColorChannels for a full color one, luminance alone otherwise
+void Canvas::computeChannels(LabImage* src, bool fullColor, MatrixXf& channels)
+{
+	channels.resize(src->res, fullColor ? 3 : 1);
+	channels.col(0) = Map<VectorXf>(src->luminance, src->res); //Same as computeLuminance
+	if (fullColor)
+	{
+		channels.col(1) = Map<VectorXf>(src->a, src->res);
+		channels.col(2) = Map<VectorXf>(src->b, src->res);
+	}
+}
+
+/*
+Computes the interpolation weights between pixel (x, y) and each of its neighbors inside the image.
+The center pixel itself is left out, and so is the minus sign the matrix stores the weights with.
+@params
+offsets		the neighborhood offsets along each axis, see neighborhoodOffsets
+luminance	luminance of every pixel, see computeLuminance
+taps		gets which neighbor each weight is for: offsets[taps[i] / offsets.size()] along x, offsets[taps[i] % offsets.size()] along y
+weights		gets the weights, in the same order. They add up to 1.
+variances	the variance of every pixel's neighborhood from computeNeighborhoodVariances, or nullptr to work it out here.
+			Only the fast kernels use it.
+*/
+void Canvas::computeNeighborWeights(LabImage* src, int x, int y, std::vector<int>& offsets, VectorXf& luminance, std::vector<int>& taps, std::vector<float>& weights,
+	const float* variances)
+{
+	std::vector<float>& workingValues = weights; //Will hold the luminance of neighboring pixels until they're turned into weights
+	taps.clear();
+	workingValues.clear();
+
+	for (int offsetXIndex = 0; offsetXIndex < offsets.size(); offsetXIndex++)
+	{
+		int offsetX = offsets[offsetXIndex];
+		for (int offsetYIndex = 0; offsetYIndex < offsets.size(); offsetYIndex++)
+		{
+			int offsetY = offsets[offsetYIndex];
+			if (x + offsetX >= 0
+				&& x + offsetX < src->width
+				&& y + offsetY >= 0
+				&& y + offsetY < src->height)
+			{
+				if (offsetX != 0 || offsetY != 0)
+				{
+					taps.push_back(offsetXIndex * offsets.size() + offsetYIndex); //Which neighbor this is
+					workingValues.push_back(luminance[src->XYtoIndex(x + offsetX, y + offsetY)]); //Luminance of current neighbor
+				}
+			}
+		}
+	}
+
+	float centerLuminance = luminance[src->XYtoIndex(x, y)];
+
+	switch (interpolation.kernel)
+	{
+	case KERNEL_REFERENCE:
+		referenceWeights(workingValues, centerLuminance);
+		break;
+	case KERNEL_FAST:
+		if (variances != nullptr)
+			fastWeights(workingValues.data(), workingValues.size(), centerLuminance, variances[src->XYtoIndex(x, y)]);
+		else
+			fastWeights(workingValues.data(), workingValues.size(), centerLuminance);
+		break;
+	case KERNEL_CHECKED:
+	{
+		std::vector<float> reference = workingValues;
+		referenceWeights(reference, centerLuminance);
+		if (variances != nullptr)
+			fastWeights(workingValues.data(), workingValues.size(), centerLuminance, variances[src->XYtoIndex(x, y)]);
+		else
+			fastWeights(workingValues.data(), workingValues.size(), centerLuminance);
+
+		float difference = 0.0f;
+		for (int i = 0; i < workingValues.size(); i++)
+		{
+			difference = std::max(difference, std::abs(workingValues[i] - reference[i]));
+		}
+		float biggest = kernelDifference;
+		while (difference > biggest && !kernelDifference.compare_exchange_weak(biggest, difference)) {} //Several threads build at once
+	}
+		break;
+	}
+}
+
+/*
+The original way of turning the luminance of a pixel's neighbors into its weights, in place.
+It's here as the reference Eisel::fastWeights is checked against, see WeightKernel.
+*/
+void Canvas::referenceWeights(std::vector<float>& workingValues, float centerLuminance)
+{
+	/*
+	'neighbors' excludes the center pixel itself.
+	For most calculations that's what we want,
+	but for avgDeviation we need the avg to be calculated including the center pixel.
+	*/
+	workingValues.push_back(centerLuminance);
+	float avgLuminance = avgFloats(workingValues);
+
+	std::vector<float> avgDeviation = std::vector<float>(workingValues.size());
+	for (int i = 0; i < workingValues.size(); i++)
+	{
+		avgDeviation[i] = pow(workingValues[i] - avgLuminance, 2);
+	}
+	float csig = avgFloats(avgDeviation);
+
+	workingValues.pop_back(); //Remove center pixel after calculating avg
+
+	csig *= 0.6;
+	std::vector<float> deviationFromCenter = std::vector<float>(workingValues.size());
+	for (int i = 0; i < workingValues.size(); i++)
+	{
+		deviationFromCenter[i] = pow(centerLuminance - workingValues[i], 2);
+	}
+	float smallestDeviation = minFloats(deviationFromCenter);
+	if (csig < -smallestDeviation / log(0.01f))
+		csig = -smallestDeviation / log(0.01f);
+	if (csig < 0.000002)
+		csig = 0.000002f;
+
+	for (int i = 0; i < workingValues.size(); i++)
+	{
+		workingValues[i] = exp(-pow(centerLuminance - workingValues[i], 2.0f) / csig);
+	}
+	float sum = sumFloats(workingValues);
+	for (int i = 0; i < workingValues.size(); i++)
+	{
+		workingValues[i] /= sum;
+	}
+}
+
+/*
+The variance of every pixel's neighborhood (the pixel included), for computeNeighborWeights.
+It goes through the image a row at a time with Eisel::streamVariances, which takes the same time for any k
+instead of a pass over the k * k neighbors, and only needs k rows of luminance at a time.
+Leaves variances empty for KERNEL_REFERENCE, which doesn't use it.
+*/
+void Canvas::computeNeighborhoodVariances(LabImage* src, std::vector<int>& offsets, VectorXf& luminance, std::vector<float>& variances)
+{
+	variances.clear();
+	if (interpolation.kernel == KERNEL_REFERENCE)
+		return;
+
+	int width = src->width;
+	variances.resize(src->res);
+	streamVariances(width, src->height, offsets, [&](int y, float* row)
+	{
+		std::copy(luminance.data() + (size_t)y * width, luminance.data() + (size_t)(y + 1) * width, row);
+	}, [&](int y, const float* rowVariances)
+	{
+		std::copy(rowVariances, rowVariances + width, variances.data() + (size_t)y * width);
+	});
+}
+
+/*
+The variances for the weights of the image 'setup' is for. They only depend on the image and k,
+so the first solve of it computes them and the rest (the other extrema map, solveComponents and the matrix it leaves) reuse them.
+Without a setup they're computed into 'own'.
+@returns nullptr for KERNEL_REFERENCE, which doesn't use them
+*/
+const float* Canvas::neighborhoodVariances(LabImage* src, std::vector<int>& offsets, VectorXf& luminance, InterpolationSetup* setup, std::vector<float>& own)
+{
+	std::vector<float>& variances = setup != nullptr ? setup->variances : own;
+	if (setup == nullptr || !setup->hasVariances)
+	{
+		computeNeighborhoodVariances(src, offsets, luminance, variances);
+		if (setup != nullptr)
+			setup->hasVariances = true;
+	}
+	return variances.empty() ? nullptr : variances.data();
+}
+
+/*
+Fills A with the interpolation weights of every pixel.
+The weights only depend on luminance and the extrema,
+so the same matrix can be solved against any number of channels.
+@params
+src			the image
+k			the length of each edge of the neighborhood. The neighborhood ends up being k * k pixels centered on one central pixel.
+extremaMap	a vector containing flags for each pixel. 1 means the corresponding pixel is an extrema, 0 means it's not.
+luminance	luminance of every pixel, see computeLuminance
+A			the matrix to fill. It is resized to imgRes * imgRes.
+setup		where to find or keep the neighborhood variances, or nullptr to compute them just for this
+*/
+void Canvas::buildInterpolationMatrix(LabImage* src, int k, std::vector<int>* extremaMap, VectorXf& luminance, SparseColumns& A, InterpolationSetup* setup)
+{
+	std::vector<int> offsets = neighborhoodOffsets(k); //Usually -k / 2 to k / 2, which covers all pixels surrounding the current center pixel
+	int neighborhoodSize = offsets.size() * offsets.size();
+
+	A.resize(src->res, src->res); //'A' has one coordinate pair per pixel.
+	/*
+	Now we reserve room for k*k non-zero entries per column (fewer for dilated neighborhoods).
+	This step is crucial to making the matrix insertions reasonably fast.
+	*/
+	A.reserve(VectorXd::Constant(src->res, neighborhoodSize));
+
+	std::vector<int> taps;
+	taps.reserve(neighborhoodSize);
+	std::vector<float> weights;
+	weights.reserve(neighborhoodSize);
+	std::vector<float> ownVariances;
+	const float* variances = neighborhoodVariances(src, offsets, luminance, setup, ownVariances);
+
+	/*
+	Outer loop goes through y indices,
+	Inner loop goes through x.
+	This is because the sparse matrix needs to be set up in THIS ORDER EXACTLY
+	Don't mess with me.
+	:P
+	*/
+	for (int y = 0; y < src->height; y++)
+	{
+		checkProgress("Building matrix", y, src->height);
+
+		for (int x = 0; x < src->width; x++)
+		{
+			int center = src->XYtoIndex(x, y);
+			if (!extremaMap->at(center))	//Only interpolate value if it's not an extrema.
+			{								//This means extrema will always keep their luminance values. In theory.
+				computeNeighborWeights(src, x, y, offsets, luminance, taps, weights, variances);
+
+				//Now add all the neighbors to matrix A with the weights we calculated
+				for (int i = 0; i < weights.size(); i++)
+				{
+					int neighbor = src->XYtoIndex(x + offsets[taps[i] / offsets.size()], y + offsets[taps[i] % offsets.size()]);
+					A.insert(center, neighbor) = -weights[i]; //Negate the values before storing them
+				}
+			}
+
+			//Now add center pixel with weight=1
+			A.insert(center, center) = 1.0f;
+		}
+	}
+	reportKernelDifference();
+}
+
+/*
+Same as buildInterpolationMatrix, but fills a StencilMatrix.
+Every pixel's weights go in their own slots, so rows of pixels are filled in parallel.
+@params
+built		if A already holds the rows for another extrema map of the same image, that map.
+			Only the rows of pixels that are extrema in one map and not the other are rewritten.
+setup		where to find or keep the neighborhood variances, or nullptr to compute them just for this
+*/
+void Canvas::buildStencilMatrix(LabImage* src, int k, std::vector<int>* extremaMap, VectorXf& luminance, StencilMatrix& A, const std::vector<int>* built,
+	InterpolationSetup* setup)
+{
+	std::vector<int> offsets = neighborhoodOffsets(k);
+	int centerTap = A.tapIndex(offsets.size() / 2, offsets.size() / 2); //The offsets are symmetric, so 0 is in the middle
+	if (built == nullptr)
+		std::fill(A.tapWeights(centerTap), A.tapWeights(centerTap) + A.res, 1.0f);
+	std::vector<float> ownVariances;
+	const float* variances = neighborhoodVariances(src, offsets, luminance, setup, ownVariances);
+
+	//Exceptions can't leave the threads, so they just stop early when cancelled and we check afterwards
+	parallelFor(0, src->height, [&](int firstRow, int lastRow)
+	{
+		std::vector<int> taps;
+		std::vector<float> weights;
+		for (int y = firstRow; y < lastRow && !cancelRequested; y++)
+		{
+			if (firstRow == 0)
+				postProgress("Building matrix", y, lastRow);
+
+			for (int x = 0; x < src->width; x++)
+			{
+				int center = src->XYtoIndex(x, y);
+				bool extremum = extremaMap->at(center) != 0;
+				if (built != nullptr && (built->at(center) != 0) == extremum)
+					continue; //Already right
+
+				if (!extremum)
+				{
+					computeNeighborWeights(src, x, y, offsets, luminance, taps, weights, variances);
+					for (int i = 0; i < weights.size(); i++)
+					{
+						A.tapWeights(taps[i])[center] = -weights[i];
+					}
+				}
+				else //Only when patching, a new matrix starts out with rows of extrema
+				{
+					for (int tap = 0; tap < A.tapX.size(); tap++)
+					{
+						if (tap != centerTap)
+							A.tapWeights(tap)[center] = 0.0f;
+					}
+				}
+			}
+		}
+	}, 4);
+	checkProgress("Building matrix", 1, 1);
+	reportKernelDifference();
+}
+
+//In KERNEL_CHECKED mode, prints how far the fast weights were from the reference ones since the last report
+void Canvas::reportKernelDifference()
+{
+	if (interpolation.kernel != KERNEL_CHECKED)
+		return;
+
+	float difference = kernelDifference.exchange(0.0f);
+	printf("Fast weights differ from the reference by up to %g (tolerance %g)%s\n", difference, WEIGHT_KERNEL_TOLERANCE,
+		difference > WEIGHT_KERNEL_TOLERANCE ? ", which is TOO MUCH" : "");
+}
+
+/*
+Interpolates luminance values across the image,
+holding local extrema constant and modifying neighboring values to smoothly transition between them.
+@params
+src			the image
+k			the length of each edge of the neighborhood. The neighborhood ends up being k * k pixels centered on one central pixel.
+extremaMap	a vector containing flags for each pixel. 1 means the corresponding pixel is an extrema, 0 means it's not.
+*/
+VectorXf Canvas::interpolateExtrema(LabImage* src, int k, std::vector<int>* extremaMap)
+{
+	MatrixXf luminance = computeLuminance(src);
+	return interpolateExtrema(src, k, extremaMap, luminance).col(0);
+}
+
+/*
+Interpolates several channels across the image at once.
+Every channel uses the luminance-based weights and keeps its own values at the extrema.
+The matrix and its preconditioner are set up once and the channels are solved in parallel.
+@params
+channels	one column per channel, one row per pixel.
+@returns	the interpolated channels, same layout as 'channels'.
+*/
+MatrixXf Canvas::interpolateExtrema(LabImage* src, int k, std::vector<int>* extremaMap, MatrixXf& channels)
+{
+	MatrixXf x;
+	interpolateExtrema(src, k, extremaMap, channels, x, nullptr);
+	return x;
+}
+
+/*
+Same, into 'x'.
+workspace	if not nullptr, where to work. Its setup may hold what's left from solving another extrema map of the same image,
+			which this solve adds to in turn (see InterpolationSetup). nullptr allocates everything and frees it as soon as it can.
+*/
+void Canvas::interpolateExtrema(LabImage* src, int k, std::vector<int>* extremaMap, MatrixXf& channels, MatrixXf& x, DecompositionWorkspace* workspace)
+{
+	if (interpolation.method == INTERPOLATE_APPROXIMATE)
+	{
+		x = interpolateExtremaApprox(src, k, extremaMap, channels);
+		return;
+	}
+	if (interpolation.method == INTERPOLATE_RELAXED)
+	{
+		x = interpolateExtremaRelaxed(src, k, extremaMap, channels);
+		return;
+	}
+
+	DecompositionWorkspace ownWorkspace; //Just empty buffers until they're used
+	DecompositionWorkspace& work = workspace != nullptr ? *workspace : ownWorkspace;
+	InterpolationSetup* setup = workspace != nullptr ? &work.setup : nullptr;
+
+	VectorXf& luminance = work.setup.luminance;
+	if (!work.setup.hasLuminance)
+	{
+		computeLuminance(src, luminance);
+		work.setup.hasLuminance = true;
+	}
+
+	//Parts of the image that are walled off by extrema are solved first, and then count as extrema for the rest
+	std::vector<int>& solvedMap = work.solvedMap;
+	MatrixXf& solvedValues = work.solvedValues;
+	MatrixXf* fixedValues = &channels;
+	if (interpolation.splitComponents && !interpolation.refine)
+	{
+		if (solveComponents(src, k, extremaMap, luminance, channels, solvedMap, solvedValues, work))
+		{
+			x = solvedValues;
+			return;
+		}
+		if (!solvedMap.empty())
+		{
+			extremaMap = &solvedMap;
+			fixedValues = &solvedValues;
+		}
+	}
+
+	MatrixXf& b = work.b;
+	b.resize(src->res, channels.cols());
+	for (int i = 0; i < b.rows(); i++) //We want the solver to keep extrema values the same. Only non-extrema are interpolated.
+	{
+		if (extremaMap->at(i) != 0)
+		{
+			b.row(i) = fixedValues->row(i);
+		}
+		else
+		{
+			b.row(i).setZero();
+		}
+	}
+
+	//Stencils are stored in image order, so any other order needs the general sparse matrix
+	if (interpolation.format == MATRIX_STENCIL && interpolation.ordering == ORDER_ROW_MAJOR)
+	{
+		//Rows can only be patched while the weights are float, so with fp16 weights every solve builds its own matrix
+		bool shared = setup != nullptr && interpolation.weights == WEIGHTS_FLOAT;
+		StencilMatrix* matrix = shared ? setup->stencil : nullptr;
+		HierarchicalBasis* basis = nullptr;
+		try
+		{
+			if (matrix != nullptr && !setup->fixed.empty())
+			{
+				buildStencilMatrix(src, k, extremaMap, luminance, *matrix, &setup->fixed, &work.setup);
+			}
+			else
+			{
+				std::vector<int> offsets = neighborhoodOffsets(k);
+				if (matrix != nullptr)
+				{
+					matrix->reset(src->width, src->height, offsets); //Left from another image, which only its memory is any good for
+				}
+				else
+				{
+					matrix = new StencilMatrix(src->width, src->height, offsets);
+					if (shared)
+						setup->stencil = matrix;
+				}
+				buildStencilMatrix(src, k, extremaMap, luminance, *matrix, nullptr, &work.setup);
+			}
+			if (shared)
+				setup->fixed = *extremaMap;
+			if (setup == nullptr)
+			{
+				luminance.resize(0);
+				std::vector<float>().swap(work.setup.variances);
+			}
+			StencilMatrix& A = *matrix;
+
+			/*
+			Has to be done before the weights are compressed.
+			The basis isn't shared: every extremum cuts it off at every level, so it would change almost everywhere.
+			*/
+			if (interpolation.preconditioner == PRECONDITION_HIERARCHICAL)
+			{
+				basis = buildHierarchicalBasis(src, extremaMap, [&](int row, std::vector<int>& columns, std::vector<float>& values) { A.row(row, columns, values); });
+			}
+			if (interpolation.weights == WEIGHTS_HALF)
+			{
+				A.compressWeights();
+			}
+
+			//Every diagonal entry of A is 1, so a diagonal preconditioner would do nothing. These do the same nothing.
+			if (interpolation.solver == SOLVER_PARALLEL)
+			{
+				MatrixProduct precondition;
+				if (basis != nullptr)
+					precondition = [&](const float* in, float* out) { basis->apply(in, out); };
+				solveChannelsParallel([&](const float* in, float* out) { A.multiply(in, out); }, [&](const double* in, double* out) { A.multiply(in, out); }, nullptr, b, x, precondition, &work);
+			}
+			else if (basis != nullptr)
+			{
+				x = solveChannels(A, *basis, b);
+			}
+			else
+			{
+				IdentityPreconditioner preconditioner;
+				x = solveChannels(A, preconditioner, b);
+			}
+		}
+		catch (...)
+		{
+			delete basis;
+			if (!shared)
+				delete matrix;
+			throw;
+		}
+		delete basis;
+		if (!shared)
+			delete matrix;
+		return;
+	}
+
+	SparseColumns A;
+	buildInterpolationMatrix(src, k, extremaMap, luminance, A, &work.setup);
+	if (setup == nullptr)
+	{
+		luminance.resize(0); //The sparse matrix is a memory hog. To help not crash the program, I delete everything I can as soon as I can.
+		std::vector<float>().swap(work.setup.variances);
+	}
+
+	//The hierarchical basis is laid out like the image, so it's only used when the pixels aren't renumbered
+	HierarchicalBasis* basis = nullptr;
+	if (interpolation.preconditioner == PRECONDITION_HIERARCHICAL && interpolation.ordering == ORDER_ROW_MAJOR)
+	{
+		SparseRows rowMajor(A);
+		basis = buildHierarchicalBasis(src, extremaMap, [&](int row, std::vector<int>& columns, std::vector<float>& values)
+		{
+			for (SparseRows::InnerIterator it(rowMajor, row); it; ++it)
+			{
+				columns.push_back(it.col());
+				values.push_back(it.value());
+			}
+		});
+	}
+
+	/*
+	Renumber the pixels if asked to: A becomes P * A * P^-1 and b becomes P * b.
+	The solution comes out in the new order and is put back at the end.
+	Any order gives the same solution, so a shared one is used as is, even if it was worked out from the other extrema.
+	*/
+	std::vector<int> newIndex;
+	if (setup != nullptr && setup->ordered)
+	{
+		newIndex = setup->newIndex;
+	}
+	else
+	{
+		computeOrdering(src, interpolation.ordering, A, newIndex);
+		if (setup != nullptr)
+		{
+			setup->newIndex = newIndex;
+			setup->ordered = true;
+		}
+	}
+	if (!newIndex.empty())
+	{
+		PermutationMatrix<Dynamic, Dynamic, SparseIndex> permutation(src->res);
+		std::copy(newIndex.begin(), newIndex.end(), permutation.indices().data());
+		SparseColumns reordered;
+		reordered = A.twistedBy(permutation);
+		A.swap(reordered);
+		reordered.resize(0, 0);
+		b = permutation * b;
+	}
+
+	try
+	{
+		if (interpolation.solver == SOLVER_PARALLEL)
+		{
+			//The parallel product works on rows, so it wants the matrix stored a row at a time
+			SparseRows rowMajor(A);
+			A.resize(0, 0);
+			A.data().squeeze();
+
+			//What DiagonalPreconditioner uses
+			VectorXf inverseDiagonal = VectorXf::Ones(src->res);
+			for (int row = 0; row < rowMajor.outerSize(); row++)
+			{
+				for (SparseRows::InnerIterator it(rowMajor, row); it; ++it)
+				{
+					if (it.col() == row && it.value() != 0.0f)
+						inverseDiagonal[row] = 1.0f / it.value();
+				}
+			}
+
+			MatrixProduct precondition;
+			if (basis != nullptr)
+				precondition = [&](const float* in, float* out) { basis->apply(in, out); };
+			solveChannelsParallel([&](const float* in, float* out) { sparseProduct(rowMajor, in, out); },
+				[&](const double* in, double* out) { sparseProduct(rowMajor, in, out); }, inverseDiagonal.data(), b, x, precondition, &work);
+		}
+		else if (basis != nullptr)
+		{
+			x = solveChannels(A, *basis, b);
+		}
+		else
+		{
+			DiagonalPreconditioner<float> preconditioner;
+			preconditioner.compute(A);
+			x = solveChannels(A, preconditioner, b);
+		}
+	}
+	catch (...)
+	{
+		delete basis;
+		throw;
+	}
+	delete basis;
+
+	if (!newIndex.empty())
+	{
+		MatrixXf reordered(x.rows(), x.cols());
+		for (int i = 0; i < src->res; i++)
+		{
+			reordered.row(i) = x.row(newIndex[i]);
+		}
+		x.swap(reordered);
+	}
+}
+
+/*
+Solves the connected components of the system (see Components.h) that are worth solving on their own.
+
+The global solve spreads every iteration over all threads, and runs as many iterations as its hardest part needs.
+A component that's at most one thread's share of the free pixels is faster to solve on one thread, alongside the others,
+with only the iterations it needs. Those are built as small sparse systems of their own, with the extrema around them
+moved to the right hand side, and solved with Eisel::bicgstab. Threads take components biggest first until they run out.
+A free pixel with no free neighbors doesn't need a solve at all: it's the weighted average of the extrema around it.
+A component whose solve doesn't converge is left for the global solve.
+
+@params
+fixed		gets extremaMap with the pixels solved here marked too. Left empty if nothing was solved here.
+values		gets channels with the pixels solved here filled in
+workspace	holds the bookkeeping
+@returns	true if every free pixel was solved here, so there's no global solve left to do
+*/
+bool Canvas::solveComponents(LabImage* src, int k, std::vector<int>* extremaMap, VectorXf& luminance, MatrixXf& channels, std::vector<int>& fixed, MatrixXf& values,
+	DecompositionWorkspace& workspace)
+{
+	fixed.clear();
+	std::vector<int> offsets = neighborhoodOffsets(k);
+	std::vector<int>& component = workspace.component;
+	int count = findComponents(src->width, src->height, offsets, *extremaMap, component, &workspace.sets);
+	checkProgress("Finding components", 1, 1);
+	if (count <= 1)
+		return false; //Nothing to split
+
+	//The pixels of each component, in image order, and where each one is within its component
+	std::vector<int>& starts = workspace.starts;
+	starts.assign(count + 1, 0);
+	for (int pixel = 0; pixel < src->res; pixel++)
+	{
+		if (component[pixel] >= 0)
+			starts[component[pixel] + 1]++;
+	}
+	for (int c = 0; c < count; c++)
+	{
+		starts[c + 1] += starts[c];
+	}
+	int freePixels = starts[count];
+	std::vector<int>& pixels = workspace.pixels;
+	pixels.resize(freePixels);
+	std::vector<int>& localIndex = workspace.localIndex;
+	localIndex.assign(src->res, -1);
+	std::vector<int>& filled = workspace.filled;
+	filled.assign(starts.begin(), starts.end() - 1);
+	for (int pixel = 0; pixel < src->res; pixel++)
+	{
+		int c = component[pixel];
+		if (c >= 0)
+		{
+			localIndex[pixel] = filled[c] - starts[c];
+			pixels[filled[c]++] = pixel;
+		}
+	}
+
+	int limit = std::max(1, freePixels / threadCount());
+	std::vector<int> separate; //The components solved here, biggest first
+	for (int c = 0; c < count; c++)
+	{
+		if (starts[c + 1] - starts[c] <= limit)
+			separate.push_back(c);
+	}
+	if (separate.empty())
+		return false;
+	std::sort(separate.begin(), separate.end(), [&](int a, int b) { return starts[a + 1] - starts[a] > starts[b + 1] - starts[b]; });
+
+	const float* variances = neighborhoodVariances(src, offsets, luminance, &workspace.setup, workspace.setup.variances);
+
+	fixed = *extremaMap;
+	values = channels;
+	std::atomic<int> unsolved(0);
+	parallelTasks(separate.size(), [&](int task)
+	{
+		if (cancelRequested)
+			return;
+
+		int first = starts[separate[task]];
+		int size = starts[separate[task] + 1] - first;
+		std::vector<int> taps;
+		std::vector<float> weights;
+		std::vector<Triplet<double, SparseIndex>> entries;
+		MatrixXd rhs = MatrixXd::Zero(size, channels.cols());
+		for (int i = 0; i < size; i++)
+		{
+			int pixel = pixels[first + i];
+			int x = pixel % src->width;
+			int y = pixel / src->width;
+			computeNeighborWeights(src, x, y, offsets, luminance, taps, weights, variances);
+
+			double diagonal = 0.0;
+			for (int j = 0; j < weights.size(); j++)
+			{
+				int neighbor = src->XYtoIndex(x + offsets[taps[j] / offsets.size()], y + offsets[taps[j] % offsets.size()]);
+				if (extremaMap->at(neighbor))
+					rhs.row(i) += (double)weights[j] * channels.row(neighbor).cast<double>();
+				else
+					entries.push_back(Triplet<double, SparseIndex>(i, localIndex[neighbor], -weights[j]));
+				diagonal += weights[j];
+			}
+			entries.push_back(Triplet<double, SparseIndex>(i, i, diagonal));
+		}
+
+		/*
+		This is solved in double, with the diagonal set to what the weights really add up to instead of 1.
+		A part that's almost walled off can hang onto the extrema around it by weights of 1e-7 or less,
+		which is lost in the rounding of float weights that should add up to 1: the solution would come out as whatever the rounding says.
+		This way what's left of every row is exactly its weight on the extrema, so the solution stays an average of them.
+		*/
+		if (size == 1)
+		{
+			//A pixel with no weight on any neighbor (a 1 x 1 image, or weights that all came out 0) keeps its own value
+			double diagonal = entries[0].value();
+			if (diagonal > 0.0)
+				values.row(pixels[first]) = (rhs.row(0) / diagonal).cast<float>();
+		}
+		else
+		{
+			SparseMatrix<double, RowMajor, SparseIndex> A(size, size);
+			A.setFromTriplets(entries.begin(), entries.end());
+			IdentityPreconditioner preconditioner; //The diagonal is within rounding of 1
+			for (int c = 0; c < channels.cols(); c++)
+			{
+				VectorXd b = rhs.col(c);
+				VectorXd result = b;
+				int iterations = size;
+				double tolerance = NumTraits<float>::epsilon();
+				bool completed = Eisel::bicgstab(A, b, result, preconditioner, iterations, tolerance, [&](int, float) { return !cancelRequested; });
+				if (!completed || !(tolerance <= NumTraits<float>::epsilon()))
+				{
+					//Cancelled, or it didn't converge. Either way the component is left to the global solve, as if it had never been split off.
+					for (int i = 0; i < size; i++)
+					{
+						values.row(pixels[first + i]) = channels.row(pixels[first + i]);
+					}
+					unsolved++;
+					return;
+				}
+				for (int i = 0; i < size; i++)
+				{
+					values(pixels[first + i], c) = (float)result[i];
+				}
+			}
+		}
+
+		for (int i = 0; i < size; i++)
+		{
+			fixed[pixels[first + i]] = 1;
+		}
+	});
+	checkProgress("Solving components", 1, 1);
+
+	return separate.size() == count && unsolved == 0;
+}
+
+/*
+Solves A * x = b for every column of b.
+
+The Eigen framework has a variety of sparse matrix solvers available.
+Only 2 of the several I tried gave the results we wanted:
+BiCGSTAB and SparseLU.
+I chose BiCGSTAB because it was 3 times faster.
+
+BiCGSTAB solves one column at a time, so we run the bicgstab routine directly (see Solver.h),
+one thread per channel, all sharing the same matrix and preconditioner.
+The settings match what BiCGSTAB::solve would use.
+Every iteration checks for cancellation, and the first channel reports progress.
+Throws DecompositionFailed if a channel stops without converging, like solveChannelsParallel.
+*/
+template<typename MatrixType, typename Preconditioner>
+MatrixXf Canvas::solveChannels(const MatrixType& A, const Preconditioner& preconditioner, MatrixXf& b)
+{
+	MatrixXf x(b.rows(), b.cols());
+	std::vector<int> iterations(b.cols(), A.cols());
+	std::vector<float> tolerances(b.cols(), NumTraits<float>::epsilon()); //Each channel's relative residual when it's done
+	std::vector<std::thread> workers;
+	for (int c = 0; c < b.cols(); c++)
+	{
+		workers.push_back(std::thread([&, c]()
+		{
+			VectorXf rhs = b.col(c);
+			VectorXf result = rhs; //BiCGSTAB::solve starts from x = b
+			float tolerance = NumTraits<float>::epsilon();
+			Eisel::bicgstab(A, rhs, result, preconditioner, iterations[c], tolerances[c], [&, c](int, float residual)
+			{
+				if (cancelRequested)
+					return false;
+				if (c == 0 && residual > 0.0f) //Progress is how many of the residual's orders of magnitude are gone
+					postProgress("Solving", (int)(1000.0f * std::log(residual) / std::log(tolerance)), 1000);
+				return true;
+			});
+			x.col(c) = result;
+		}));
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	checkProgress("Solving", 1, 1); //The solver threads can't throw, so this is where a cancelled solve ends up
+	for (int c = 0; c < b.cols(); c++)
+	{
+		if (!(tolerances[c] <= NumTraits<float>::epsilon())) //NaN too
+			throw DecompositionFailed(solveFailure(c, iterations[c], tolerances[c]));
+	}
+
+	return x;
+}
+
+/*
+Solves A * x = b for every column of b with Eisel::parallelBicgstab,
+or Eisel::refinedBicgstab if interpolation.refine is set (multiplyDouble is only used then).
+The channels are solved one after another, since each solve already keeps every thread busy.
+Same settings, cancellation and progress as solveChannels.
+If refinement doesn't get as far as a float solve, the channel is solved again without it.
+Throws DecompositionFailed if a float solve stops without converging, rather than hand back what it got to.
+The preconditioner is inverseDiagonal, or 'precondition' if it's set (see parallelBicgstab).
+The solver's vectors are kept in 'workspace' if there is one.
+*/
+void Canvas::solveChannelsParallel(const MatrixProduct& multiply, const DoubleMatrixProduct& multiplyDouble, const float* inverseDiagonal, MatrixXf& b, MatrixXf& x,
+	const MatrixProduct& precondition, DecompositionWorkspace* workspace)
+{
+	DecompositionWorkspace ownWorkspace;
+	DecompositionWorkspace& work = workspace != nullptr ? *workspace : ownWorkspace;
+	x.resize(b.rows(), b.cols());
+	for (int c = 0; c < b.cols(); c++)
+	{
+		VectorXf& rhs = work.rhs;
+		rhs = b.col(c);
+		float tolerance = interpolation.refine ? (float)REFINED_TOLERANCE : NumTraits<float>::epsilon();
+		auto monitor = [&](int, float residual)
+		{
+			if (cancelRequested)
+				return false;
+			if (residual > 0.0f)
+				postProgress("Solving", c * 1000 + std::max(0, std::min(1000, (int)(1000.0f * std::log(residual) / std::log(tolerance)))), (int)b.cols() * 1000);
+			return true;
+		};
+
+		bool solved = false;
+		if (interpolation.refine)
+		{
+			VectorXd result;
+			int steps = REFINEMENT_STEPS;
+			double refinedTolerance = REFINED_TOLERANCE;
+			refinedBicgstab(multiply, multiplyDouble, inverseDiagonal, rhs, result, steps, refinedTolerance, monitor, precondition);
+			checkProgress("Solving", c, b.cols());
+
+			/*
+			Refinement stops early when a correction solve blows up, and if that's the first one, x is still 0.
+			Unless it got at least as far as the float solve would have, the channel is solved again without it.
+			*/
+			solved = refinedTolerance <= NumTraits<float>::epsilon();
+			if (solved)
+				x.col(c) = result.cast<float>();
+			else
+				printf("Refinement stopped at a relative residual of %g, solving in single precision instead\n", refinedTolerance);
+			tolerance = NumTraits<float>::epsilon();
+		}
+
+		if (!solved)
+		{
+			VectorXf& result = work.result;
+			result = rhs; //BiCGSTAB::solve starts from x = b
+			int iterations = b.rows();
+			parallelBicgstab(multiply, inverseDiagonal, rhs, result, iterations, tolerance, monitor, precondition, &work.solver);
+			checkProgress("Solving", c, b.cols());
+			if (!(tolerance <= NumTraits<float>::epsilon())) //NaN too
+				throw DecompositionFailed(solveFailure(c, iterations, tolerance));
+			x.col(c) = result;
+		}
+		checkProgress("Solving", c + 1, b.cols());
+	}
+}
+
+//The message DecompositionFailed is thrown with when channel c's solve gave up at this relative residual
+std::string Canvas::solveFailure(int c, int iterations, float residual)
+{
+	char message[256];
+	snprintf(message, sizeof(message), "The solve of channel %d stopped without converging after %d iterations, at a relative residual of %g", c, iterations, residual);
+	return message;
+}
+
+/*
+The hierarchical basis preconditioner for the interpolation system (see HierarchicalBasis.h).
+
+The basis needs a 4-neighbor system, so it's built from one that smooths the way the k * k weights do.
+Weights that reach d pixels away spread values about as far as d * d steps between next door pixels,
+so the connection between 2 next door pixels is how far each one's weights reach toward the other,
+the sum of weight * d^2 over its neighbors on that side, averaged between the 2.
+In a flat area that's what a k * k neighborhood of equal weights works out to, and across edges it's small like the weights are.
+Extrema are cut off from everything, like their rows of A, with a diagonal of 1.
+A free pixel's diagonal is the sum of its connections, including the ones to extrema, like a graph Laplacian.
+
+That only stands in for A at scales bigger than k. Below that, A is close to the identity while the 4-neighbor system is several times stiffer,
+and with the elimination's diagonal the solver took more iterations than with no preconditioner at all. So the basis gets A's own (see matchDiagonal).
+
+@params
+rows		the rows of A in image order, see HierarchicalBasis::RowAccess
+@returns	the basis, which the caller deletes
+*/
+HierarchicalBasis* Canvas::buildHierarchicalBasis(LabImage* src, std::vector<int>* extremaMap, const HierarchicalBasis::RowAccess& rows)
+{
+	//How far each pixel's weights reach to the left, right, top and bottom
+	std::vector<float> reach[4];
+	for (int direction = 0; direction < 4; direction++)
+	{
+		reach[direction].assign(src->res, 0.0f);
+	}
+	parallelFor(0, src->res, [&](int first, int last)
+	{
+		std::vector<int> columns;
+		std::vector<float> values;
+		for (int pixel = first; pixel < last; pixel++)
+		{
+			columns.clear();
+			values.clear();
+			rows(pixel, columns, values);
+			for (int entry = 0; entry < columns.size(); entry++)
+			{
+				//The weights are stored negated, and the diagonal's offsets are 0 so it adds nothing
+				int offsetX = columns[entry] % src->width - pixel % src->width;
+				int offsetY = columns[entry] / src->width - pixel / src->width;
+				reach[offsetX < 0 ? 0 : 1][pixel] -= values[entry] * offsetX * offsetX;
+				reach[offsetY < 0 ? 2 : 3][pixel] -= values[entry] * offsetY * offsetY;
+			}
+		}
+	}, 1024);
+
+	std::vector<float> diagonal(src->res, 0.0f), right(src->res, 0.0f), down(src->res, 0.0f);
+	for (int y = 0; y < src->height; y++)
+	{
+		for (int x = 0; x < src->width; x++)
+		{
+			int pixel = src->XYtoIndex(x, y);
+			if (extremaMap->at(pixel))
+				diagonal[pixel] += 1.0f;
+
+			//The connections to the right and below: which neighbor, how far this pixel reaches toward it, and how far it reaches back
+			for (int direction = 0; direction < 2; direction++)
+			{
+				int neighborX = x + (direction == 0 ? 1 : 0);
+				int neighborY = y + (direction == 0 ? 0 : 1);
+				if (neighborX >= src->width || neighborY >= src->height)
+					continue;
+
+				int neighbor = src->XYtoIndex(neighborX, neighborY);
+				float toward = reach[direction == 0 ? 1 : 3][pixel];
+				float back = reach[direction == 0 ? 0 : 2][neighbor];
+				bool fixed = extremaMap->at(pixel) != 0;
+				bool neighborFixed = extremaMap->at(neighbor) != 0;
+				if (fixed && neighborFixed)
+					continue;
+
+				if (neighborFixed)
+				{
+					diagonal[pixel] += toward;
+				}
+				else if (fixed)
+				{
+					diagonal[neighbor] += back;
+				}
+				else
+				{
+					float connection = 0.5f * (toward + back);
+					(direction == 0 ? right : down)[pixel] = connection;
+					diagonal[pixel] += connection;
+					diagonal[neighbor] += connection;
+				}
+			}
+		}
+	}
+	for (int direction = 0; direction < 4; direction++)
+	{
+		reach[direction] = std::vector<float>();
+	}
+
+	HierarchicalBasis* basis = new HierarchicalBasis(src->width, src->height, diagonal, right, down);
+	basis->matchDiagonal(rows);
+	return basis;
+}
+
+/*
+Fills newIndex with the new position of every pixel for 'ordering' (see Ordering.h).
+Leaves it empty for ORDER_ROW_MAJOR, which is the order A is built in.
+*/
+void Canvas::computeOrdering(LabImage* src, UnknownOrdering ordering, SparseColumns& A, std::vector<int>& newIndex)
+{
+	newIndex.clear();
+	if (ordering == ORDER_MORTON)
+	{
+		mortonOrder(src->width, src->height, newIndex);
+	}
+	else if (ordering == ORDER_RCM)
+	{
+		reverseCuthillMcKee(A, newIndex);
+	}
+}
+
+/*
+Prints how each unknown ordering does on the minima matrix of this image:
+how long it takes to compute, how far apart the columns of each row's non-zeros are
+(the maximum is the bandwidth, the mean is roughly how far apart in memory each row's reads of x are),
+the time of one matrix-vector product, and the time of the whole envelope computation.
+*/
+void Canvas::benchmarkOrderings(LabImage* image, int k)
+{
+	const char* names[] = { "row major", "morton", "rcm" };
+	const int PRODUCTS = 20;
+
+	std::vector<int>* minima = findMinima(image, k);
+	VectorXf luminance = computeLuminance(image);
+	SparseColumns A;
+	buildInterpolationMatrix(image, k, minima, luminance, A);
+	delete minima;
+	VectorXf x = luminance;
+
+	printf("\n%d x %d, k = %d, %d non-zeros\n", image->width, image->height, k, (int)A.nonZeros());
+	printf("ordering    reorder   bandwidth   mean distance   product    envelope\n");
+	UnknownOrdering previous = interpolation.ordering;
+	MatrixFormat previousFormat = interpolation.format;
+	interpolation.format = MATRIX_SPARSE; //The orderings only apply to the sparse matrix. The stencil gets its own line at the end.
+	for (int ordering = ORDER_ROW_MAJOR; ordering <= ORDER_RCM; ordering++)
+	{
+		Uint32 start = SDL_GetTicks();
+		std::vector<int> newIndex;
+		computeOrdering(image, (UnknownOrdering)ordering, A, newIndex);
+		SparseColumns reordered;
+		if (newIndex.empty())
+		{
+			reordered = A;
+		}
+		else
+		{
+			PermutationMatrix<Dynamic, Dynamic, SparseIndex> permutation(image->res);
+			std::copy(newIndex.begin(), newIndex.end(), permutation.indices().data());
+			reordered = A.twistedBy(permutation);
+		}
+		double reorderSeconds = (SDL_GetTicks() - start) / 1000.0;
+
+		long long bandwidth = 0;
+		double totalDistance = 0.0;
+		for (int j = 0; j < reordered.outerSize(); j++)
+		{
+			for (SparseColumns::InnerIterator it(reordered, j); it; ++it)
+			{
+				long long distance = std::abs((long long)it.index() - j);
+				bandwidth = std::max(bandwidth, distance);
+				totalDistance += distance;
+			}
+		}
+
+		VectorXf y(image->res);
+		start = SDL_GetTicks();
+		for (int i = 0; i < PRODUCTS; i++)
+		{
+			checkProgress("Benchmarking", ordering * PRODUCTS + i, 4 * PRODUCTS);
+			y.noalias() = reordered * x;
+		}
+		double productMs = (double)(SDL_GetTicks() - start) / PRODUCTS;
+
+		interpolation.ordering = (UnknownOrdering)ordering;
+		start = SDL_GetTicks();
+		try
+		{
+			computeEnvelope(image, k);
+		}
+		catch (...)
+		{
+			interpolation.ordering = previous;
+			interpolation.format = previousFormat;
+			throw;
+		}
+		double envelopeSeconds = (SDL_GetTicks() - start) / 1000.0;
+
+		printf("%-10s  %6.3fs  %10lld  %14.1f  %7.2fms  %8.2fs\n", names[ordering], reorderSeconds, bandwidth, totalDistance / reordered.nonZeros(), productMs, envelopeSeconds);
+	}
+	interpolation.ordering = ORDER_ROW_MAJOR;
+	interpolation.format = MATRIX_STENCIL;
+
+	//Same thing for the stencil matrix, which is always in row major order
+	std::vector<int> offsets = neighborhoodOffsets(k);
+	StencilMatrix stencil(image->width, image->height, offsets);
+	minima = findMinima(image, k);
+	buildStencilMatrix(image, k, minima, luminance, stencil);
+	delete minima;
+
+	VectorXf y(image->res);
+	Uint32 start = SDL_GetTicks();
+	for (int i = 0; i < PRODUCTS; i++)
+	{
+		checkProgress("Benchmarking", 3 * PRODUCTS + i, 4 * PRODUCTS);
+		y.noalias() = stencil * x;
+	}
+	double productMs = (double)(SDL_GetTicks() - start) / PRODUCTS;
+
+	start = SDL_GetTicks();
+	try
+	{
+		computeEnvelope(image, k);
+	}
+	catch (...)
+	{
+		interpolation.ordering = previous;
+		interpolation.format = previousFormat;
+		throw;
+	}
+	double envelopeSeconds = (SDL_GetTicks() - start) / 1000.0;
+
+	printf("%-10s  %6s   %10s  %14s  %7.2fms  %8.2fs\n", "stencil", "-", "-", "-", productMs, envelopeSeconds);
+	interpolation.ordering = previous;
+	interpolation.format = previousFormat;
+}
+
+/*
+Prints how many iterations the parallel solver takes on the minima system of this image (luminance only),
+and how long it takes, with each preconditioner. The hierarchical basis line includes the time it takes to build.
+*/
+void Canvas::comparePreconditioners(LabImage* image, int k)
+{
+	const char* names[] = { "diagonal", "hierarchical" };
+
+	std::vector<int>* minima = findMinima(image, k);
+	VectorXf luminance = computeLuminance(image);
+	std::vector<int> offsets = neighborhoodOffsets(k);
+	StencilMatrix A(image->width, image->height, offsets);
+	VectorXf b(image->res);
+	HierarchicalBasis* basis = nullptr;
+	try
+	{
+		buildStencilMatrix(image, k, minima, luminance, A);
+		for (int i = 0; i < image->res; i++)
+		{
+			b[i] = minima->at(i) ? luminance[i] : 0.0f;
+		}
+
+		printf("\n%d x %d, k = %d\n", image->width, image->height, k);
+		printf("preconditioner  iterations   residual      build     solve\n");
+		for (int type = PRECONDITION_DIAGONAL; type <= PRECONDITION_HIERARCHICAL; type++)
+		{
+			Uint32 start = SDL_GetTicks();
+			MatrixProduct precondition;
+			if (type == PRECONDITION_HIERARCHICAL)
+			{
+				basis = buildHierarchicalBasis(image, minima, [&](int row, std::vector<int>& columns, std::vector<float>& values) { A.row(row, columns, values); });
+				precondition = [&](const float* in, float* out) { basis->apply(in, out); };
+			}
+			double buildSeconds = (SDL_GetTicks() - start) / 1000.0;
+
+			VectorXf x = b;
+			int iterations = image->res;
+			float tolerance = NumTraits<float>::epsilon();
+			int steps = 0; //The solver starts counting over when it restarts, so the iterations are counted here
+			start = SDL_GetTicks();
+			parallelBicgstab([&](const float* in, float* out) { A.multiply(in, out); }, nullptr, b, x, iterations, tolerance, [&](int, float)
+			{
+				steps++;
+				return !cancelRequested;
+			}, precondition);
+			double solveSeconds = (SDL_GetTicks() - start) / 1000.0;
+			checkProgress("Benchmarking", type + 1, 2);
+
+			printf("%-14s  %10d  %9.2e  %8.2fs  %7.2fs\n", names[type], steps, tolerance, buildSeconds, solveSeconds);
+			delete basis;
+			basis = nullptr;
+		}
+	}
+	catch (...)
+	{
+		delete basis;
+		delete minima;
+		throw;
+	}
+	delete minima;
+}
+
+/*
+A fast stand-in for interpolateExtrema, for previews. Same inputs and outputs.
+
+Instead of solving for values that are a weighted average of their neighbors everywhere,
+this spreads the extrema values out with an edge-aware blur and divides by the blurred extrema mask
+(normalized convolution): every pixel ends up with an average of the nearby extrema,
+weighted by how far away they are and how many edges are in between.
+The blur is the domain transform's recursive filter, which is a handful of passes over the image
+whatever the neighborhood size is.
+
+The edges are found the same way buildInterpolationMatrix weighs neighbors:
+the luminance difference between two pixels relative to csig, the local luminance variance.
+Here csig is measured with a box filter instead of per pixel, and only direct neighbors count for the smallest deviation.
+*/
+MatrixXf Canvas::interpolateExtremaApprox(LabImage* src, int k, std::vector<int>* extremaMap, MatrixXf& channels)
+{
+	int width = src->width;
+	int height = src->height;
+	int res = src->res;
+	int sideLength = k / 2;
+	VectorXf luminance = computeLuminance(src);
+
+	//csig for every pixel: 0.6 times the variance of its neighborhood, same limits as buildInterpolationMatrix
+	checkProgress("Filtering", 0, 4);
+	std::vector<float> mean(res);
+	std::vector<float> csig(res);
+	std::vector<float> squares(res);
+	for (int i = 0; i < res; i++)
+	{
+		squares[i] = luminance[i] * luminance[i];
+	}
+	boxFilter(luminance.data(), mean.data(), width, height, sideLength);
+	boxFilter(squares.data(), csig.data(), width, height, sideLength);
+	squares = std::vector<float>(); //Free it early, the image could be big
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int i = src->XYtoIndex(x, y);
+			float center = luminance[i];
+			float smallestDeviation = FLT_MAX;
+			if (x > 0)			smallestDeviation = std::min(smallestDeviation, (center - luminance[i - 1]) * (center - luminance[i - 1]));
+			if (x < width - 1)	smallestDeviation = std::min(smallestDeviation, (center - luminance[i + 1]) * (center - luminance[i + 1]));
+			if (y > 0)			smallestDeviation = std::min(smallestDeviation, (center - luminance[i - width]) * (center - luminance[i - width]));
+			if (y < height - 1)	smallestDeviation = std::min(smallestDeviation, (center - luminance[i + width]) * (center - luminance[i + width]));
+			if (smallestDeviation == FLT_MAX)
+				smallestDeviation = 0.0f;
+
+			float variance = std::max(0.0f, csig[i] - mean[i] * mean[i]);
+			csig[i] = std::max(std::max(variance * 0.6f, -smallestDeviation / std::log(0.01f)), 0.000002f);
+		}
+	}
+
+	/*
+	Distances for the domain transform. A step between two pixels costs 1,
+	plus sigmaS times the number of "csig standard deviations" between their luminances.
+	sigmaS is how far the blur reaches. Extrema are about a neighborhood apart, and 2 neighborhoods
+	came out closest to the exact solve on the bundled images (though anything from 1 to 3 is within 1 dB).
+	*/
+	float sigmaS = 2.0f * k;
+	std::vector<float> distX(res, 1.0f);
+	std::vector<float> distY(res, 1.0f);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			int i = src->XYtoIndex(x, y);
+			if (x > 0)
+				distX[i] += sigmaS * std::abs(luminance[i] - luminance[i - 1]) / std::sqrt((csig[i] + csig[i - 1]) / 2.0f);
+			if (y > 0)
+				distY[i] += sigmaS * std::abs(luminance[i] - luminance[i - width]) / std::sqrt((csig[i] + csig[i - width]) / 2.0f);
+		}
+	}
+	csig = std::vector<float>();
+	mean = std::vector<float>();
+
+	//Blur the extrema mask and the masked channels together, then divide
+	checkProgress("Filtering", 1, 4);
+	std::vector<float> mask(res);
+	MatrixXf result(res, channels.cols());
+	for (int i = 0; i < res; i++)
+	{
+		mask[i] = extremaMap->at(i) != 0 ? 1.0f : 0.0f;
+		result.row(i) = channels.row(i) * mask[i];
+	}
+
+	std::vector<float*> planes = { mask.data() };
+	for (int c = 0; c < result.cols(); c++)
+	{
+		planes.push_back(result.col(c).data());
+	}
+	domainTransformFilter(planes, distX.data(), distY.data(), width, height, sigmaS);
+	checkProgress("Filtering", 3, 4);
+
+	for (int i = 0; i < res; i++)
+	{
+		if (extremaMap->at(i) != 0 || mask[i] < 0.000001f)
+		{
+			//Extrema keep their values, like they do in the exact solve.
+			//Pixels walled in by edges with no extrema in reach just keep theirs too.
+			result.row(i) = channels.row(i);
+		}
+		else
+		{
+			result.row(i) /= mask[i];
+		}
+	}
+	checkProgress("Filtering", 4, 4);
+
+	return result;
+}
+
+/*
+How many colors along each axis relaxSweep needs for the neighborhood 'offsets' (see neighborhoodOffsets).
+Pixel (x, y) gets color (x % colors, y % colors), so 2 pixels of the same color are a multiple of 'colors' apart along both axes,
+and that has to be more than any offset for them to be out of each other's neighborhoods.
+Red-black (2 colors in all, like a checkerboard) only works for neighborhoods without diagonals, so even k = 3 needs 2 * 2.
+Dilated neighborhoods can get away with fewer colors than their width, as long as no offset is a multiple of 'colors'.
+*/
+int Canvas::relaxationColors(std::vector<int>& offsets)
+{
+	for (int colors = 2; ; colors++)
+	{
+		bool independent = true;
+		for (int offsetX : offsets)
+		{
+			for (int offsetY : offsets)
+			{
+				if ((offsetX != 0 || offsetY != 0) && offsetX % colors == 0 && offsetY % colors == 0)
+					independent = false;
+			}
+		}
+		if (independent)
+			return colors;
+	}
+}
+
+/*
+One sweep of multicolor successive over-relaxation on the interpolation system, in place.
+
+Every pixel that isn't an extremum is moved 'omega' of the way from its value to the weighted average of its neighbors
+(plus its rhs, if there is one), a color at a time, so a pixel always sees its neighbors' newest values.
+Pixels of the same color are never in each other's neighborhoods, so each color is split between threads by rows
+and the result doesn't depend on how many threads there are.
+The weights aren't stored anywhere: they're worked out again from the luminance every time, so apart from 'values'
+this only needs the luminance. It's much slower per sweep than a matrix product for that, and it takes many more sweeps
+than BiCGSTAB takes iterations. Sweeps are also what a multigrid solve would smooth with, which is what 'rhs' is for.
+
+NaN values count as unknown: a pixel with unknown neighbors takes the weighted average of the known ones (renormalized)
+whatever omega is, and one with no known neighbors stays NaN. That's how interpolateExtremaRelaxed starts from the extrema alone.
+
+@params
+colors		from relaxationColors
+values		one column per channel, extrema rows hold their fixed values. Updated in place.
+omega		1 is Gauss-Seidel, over 1 over-relaxes. See RELAXATION_FACTOR.
+unknown		gets how many values are still NaN after the sweep
+rhs			the right-hand side for the rows of pixels that aren't extrema, or nullptr for 0 like interpolateExtrema solves for
+@returns	the squared residual summed over all pixels and channels, from before each pixel was updated.
+			Pixels with unknown neighbors don't add to it.
+*/
+double Canvas::relaxSweep(LabImage* src, std::vector<int>& offsets, int colors, VectorXf& luminance, std::vector<int>* extremaMap, MatrixXf& values, float omega,
+	int& unknown, const MatrixXf* rhs)
+{
+	int width = src->width;
+	int height = src->height;
+	int channelCount = (int)values.cols();
+
+	//Each row's share, added up in order afterwards so the total doesn't depend on the threads either
+	std::vector<double> rowResiduals(height, 0.0);
+	std::vector<int> rowUnknown(height, 0);
+
+	for (int color = 0; color < colors * colors; color++)
+	{
+		int colorX = color % colors;
+		int colorY = color / colors;
+		int rows = (height - colorY + colors - 1) / colors;
+		parallelFor(0, rows, [&](int first, int last)
+		{
+			std::vector<int> taps;
+			std::vector<float> weights;
+			std::vector<float> sums(channelCount);
+			for (int row = first; row < last; row++)
+			{
+				int y = colorY + row * colors;
+				for (int x = colorX; x < width; x += colors)
+				{
+					int pixel = src->XYtoIndex(x, y);
+					if (extremaMap->at(pixel))
+						continue;
+
+					computeNeighborWeights(src, x, y, offsets, luminance, taps, weights);
+					std::fill(sums.begin(), sums.end(), 0.0f);
+					float knownWeight = 0.0f;
+					bool missing = false;
+					for (int i = 0; i < taps.size(); i++)
+					{
+						int neighbor = src->XYtoIndex(x + offsets[taps[i] / offsets.size()], y + offsets[taps[i] % offsets.size()]);
+						if (std::isnan(values(neighbor, 0)))
+						{
+							missing = true;
+							continue;
+						}
+
+						knownWeight += weights[i];
+						for (int c = 0; c < channelCount; c++)
+						{
+							sums[c] += weights[i] * values(neighbor, c);
+						}
+					}
+
+					if (missing || std::isnan(values(pixel, 0)))
+					{
+						if (knownWeight > 0.0f)
+						{
+							for (int c = 0; c < channelCount; c++)
+							{
+								values(pixel, c) = (sums[c] + (rhs != nullptr ? (*rhs)(pixel, c) : 0.0f)) / knownWeight;
+							}
+						}
+						else if (std::isnan(values(pixel, 0)))
+						{
+							rowUnknown[y]++;
+						}
+						continue;
+					}
+
+					for (int c = 0; c < channelCount; c++)
+					{
+						float residual = sums[c] + (rhs != nullptr ? (*rhs)(pixel, c) : 0.0f) - values(pixel, c);
+						rowResiduals[y] += residual * residual;
+						values(pixel, c) += omega * residual;
+					}
+				}
+			}
+		});
+	}
+
+	double residual = 0.0;
+	unknown = 0;
+	for (int y = 0; y < height; y++)
+	{
+		residual += rowResiduals[y];
+		unknown += rowUnknown[y];
+	}
+	return residual;
+}
+
+/*
+Same as interpolateExtrema, but solved with relaxSweep instead of BiCGSTAB, for when there isn't memory for the matrix:
+it only needs the luminance and the values it returns, a float plane each per channel.
+The sweeps go on until the relative residual is under RELAXED_TOLERANCE, which is looser than the exact solve's
+because every sweep costs as much as building the matrix.
+*/
+MatrixXf Canvas::interpolateExtremaRelaxed(LabImage* src, int k, std::vector<int>* extremaMap, MatrixXf& channels)
+{
+	VectorXf luminance = computeLuminance(src);
+	std::vector<int> offsets = neighborhoodOffsets(k);
+	int colors = relaxationColors(offsets);
+
+	//Extrema keep their values. Everything else starts out unknown and is filled in from the extrema by the first few sweeps.
+	MatrixXf values(src->res, channels.cols());
+	double rhsSqNorm = 0.0;
+	for (int i = 0; i < src->res; i++)
+	{
+		if (extremaMap->at(i))
+		{
+			values.row(i) = channels.row(i);
+			rhsSqNorm += channels.row(i).squaredNorm();
+		}
+		else
+		{
+			values.row(i).setConstant(std::numeric_limits<float>::quiet_NaN());
+		}
+	}
+	if (rhsSqNorm == 0.0) //Same as the exact solve
+	{
+		values.setZero();
+		return values;
+	}
+
+	int unknown = src->res;
+	for (int sweep = 0; sweep < RELAXATION_SWEEPS; sweep++)
+	{
+		bool filled = unknown == 0;
+		int stillUnknown;
+		double residual = relaxSweep(src, offsets, colors, luminance, extremaMap, values, RELAXATION_FACTOR, stillUnknown);
+		if (!filled)
+		{
+			//Pixels no extremum reaches through the neighborhoods would stay unknown forever. The exact solve has nothing to go on for them either.
+			if (stillUnknown == unknown && stillUnknown > 0)
+			{
+				for (int i = 0; i < src->res; i++)
+				{
+					if (std::isnan(values(i, 0)))
+						values.row(i).setZero();
+				}
+				stillUnknown = 0;
+			}
+			unknown = stillUnknown;
+			checkProgress("Relaxing", 0, 1000);
+			continue;
+		}
+
+		double relative = std::sqrt(residual / rhsSqNorm);
+		if (relative <= RELAXED_TOLERANCE)
+			break;
+		checkProgress("Relaxing", (int)(1000.0 * std::log(relative) / std::log(RELAXED_TOLERANCE)), 1000); //Same as solveChannels
+	}
+	return values;
+}
+
+/*
+Prints how far the approximate envelope is from the exact one for this image, and how long each took.
+The error is in L units (0 to 100), the same as the difference it makes to the residual and detail layers.
+*/
+void Canvas::compareInterpolation(LabImage* image, int k)
+{
+	const InterpolationMethod methods[3] = { INTERPOLATE_EXACT, INTERPOLATE_APPROXIMATE, INTERPOLATE_RELAXED };
+	const char* names[3] = { "exact", "approximate", "relaxed" };
+	InterpolationMethod method = interpolation.method;
+	MatrixXf envelopes[3];
+	double seconds[3];
+
+	try
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			interpolation.method = methods[i];
+			Uint32 start = SDL_GetTicks();
+			envelopes[i] = computeEnvelope(image, k);
+			seconds[i] = (SDL_GetTicks() - start) / 1000.0;
+		}
+	}
+	catch (...)
+	{
+		interpolation.method = method;
+		throw;
+	}
+	interpolation.method = method;
+
+	printf("\n%d x %d, k = %d\n", image->width, image->height, k);
+	printf("exact:       %.3fs\n", seconds[0]);
+	for (int i = 1; i < 3; i++)
+	{
+		ArrayXf error = (envelopes[i].col(0) - envelopes[0].col(0)).array().abs() * 100.0f;
+		float rms = std::sqrt(error.square().mean());
+		printf("%-12s %.3fs (%.2fx the time)\n", (std::string(names[i]) + ":").c_str(), seconds[i], seconds[i] / std::max(seconds[0], 0.001));
+		printf("  error in L: mean %.3f, rms %.3f, max %.3f, PSNR %.1f dB\n", error.mean(), rms, error.maxCoeff(), 20.0 * log10(100.0 / std::max(rms, 0.000001f)));
+	}
+}
+
+void Canvas::fillWithMultiDecompResidual(Window* window, VectorXf* multiDecompValues)
+{
+	MatrixXf luminance = *multiDecompValues;
+	fillWithMultiDecompResidual(window, &luminance);
+}
+
+void Canvas::fillWithMultiDecompResidual(Window* window, MatrixXf* multiDecompValues)
+{
+	bool fullColor = multiDecompValues->cols() == 3; //Full color: the residual takes the smoothed a and b channels as well
+	LabImage* lab = window->lab;
+
+	for (int i = 0; i < lab->res; i++)
+	{
+		float avg = (*multiDecompValues)(i, 0);
+		avg *= 100.0f; //From [0.0, 1.0] to [0.0, 100.0]
+		lab->l[i] = std::min(100.0f, std::max(0.0f, avg)); //Clamp to [0.0, 100.0]
+		if (fullColor)
+		{
+			lab->a[i] = (*multiDecompValues)(i, 1);
+			lab->b[i] = (*multiDecompValues)(i, 2);
+		}
+	}
+	lab->updateLuminance();
+}
+
+void Canvas::fillWithMultiDecompDetail(Window* window, VectorXf* multiDecompValues)
+{
+	MatrixXf luminance = *multiDecompValues;
+	fillWithMultiDecompDetail(window, &luminance);
+}
+
+void Canvas::fillWithMultiDecompDetail(Window* window, MatrixXf* multiDecompValues)
+{
+	bool fullColor = multiDecompValues->cols() == 3; //Full color: a and b hold the chroma detail, halved so it stays within [-128.0, 128.0]
+	LabImage* lab = window->lab;
+
+	for (int i = 0; i < lab->res; i++)
+	{
+		float avg = (*multiDecompValues)(i, 0);
+		avg *= 100.0f; //From [0.0, 1.0] to [0.0, 100.0]
+		avg = std::min(100.0f, std::max(0.0f, avg)); //Clamp to [0.0, 100.0]
+
+		float l = lab->l[i];
+		l = l - avg; //Now in [-100.0, 100.0]
+		lab->l[i] = (l + 100.0f) / 2.0f; //Now in [0.0, 100.0]
+		if (fullColor)
+		{
+			lab->a[i] = (lab->a[i] - (*multiDecompValues)(i, 1)) / 2.0f;
+			lab->b[i] = (lab->b[i] - (*multiDecompValues)(i, 2)) / 2.0f;
+		}
+	}
+	lab->updateLuminance();
+}
+
+/*
+Does the work of fillWithMultiDecompResidual and fillWithMultiDecompDetail in a single pass.
+Each source pixel is read once and all outputs are written, so nothing needs to be filled with the source first.
+detailLab gets the detail packed for display, detailLayer gets it unpacked. Either can be nullptr.
+detailLayer's luminance plane is left alone, since a signed layer isn't an image anyone decomposes.
+'source' may be the same image as residualLab. Rows are split between threads.
+*/
+void Canvas::fillWithMultiDecompLayers(LabImage* source, LabImage* residualLab, LabImage* detailLab, LabImage* detailLayer, MatrixXf* multiDecompValues)
+{
+	bool fullColor = multiDecompValues->cols() == 3;
+
+	parallelFor(0, source->height, [&](int firstRow, int lastRow)
+	{
+		for (int i = source->XYtoIndex(0, firstRow); i < source->XYtoIndex(0, lastRow); i++)
+		{
+			float avg = (*multiDecompValues)(i, 0);
+			avg *= 100.0f; //From [0.0, 1.0] to [0.0, 100.0]
+			avg = std::min(100.0f, std::max(0.0f, avg)); //Clamp to [0.0, 100.0]
+
+			float l = source->l[i];
+			float a = source->a[i];
+			float b = source->b[i];
+
+			float detailL = l - avg; //In [-100.0, 100.0]
+			float detailA = 0.0f; //Luminance-only decompositions leave all the chroma in the residual
+			float detailB = 0.0f;
+			if (fullColor)
+			{
+				detailA = a - (*multiDecompValues)(i, 1);
+				detailB = b - (*multiDecompValues)(i, 2);
+				a = (*multiDecompValues)(i, 1);
+				b = (*multiDecompValues)(i, 2);
+			}
+
+			residualLab->l[i] = avg;
+			residualLab->a[i] = a;
+			residualLab->b[i] = b;
+
+			if (detailLab != nullptr)
+			{
+				//Same packing as fillWithMultiDecompDetail
+				detailLab->l[i] = (detailL + 100.0f) / 2.0f; //From [-100.0, 100.0] to [0.0, 100.0]
+				detailLab->a[i] = fullColor ? detailA / 2.0f : a;
+				detailLab->b[i] = fullColor ? detailB / 2.0f : b;
+			}
+
+			if (detailLayer != nullptr)
+			{
+				detailLayer->l[i] = detailL;
+				detailLayer->a[i] = detailA;
+				detailLayer->b[i] = detailB;
+			}
+		}
+	});
+
+	residualLab->updateLuminance();
+	if (detailLab != nullptr)
+		detailLab->updateLuminance();
+}
+
+void Canvas::fillWithMaximaOnly(Window* window, int k)
+{
+	auto maxima = findMaxima(window->lab, k);
+	for (int i = 0; i < maxima->size(); i++)
+	{
+		if (!maxima->at(i))
+		{
+			window->lab->l[i] = 0.0f; //Black
+			window->lab->a[i] = 0.0f;
+			window->lab->b[i] = 0.0f;
+			window->lab->luminance[i] = 0.0f;
+		}
+	}
+
+	delete maxima;
+}
+
+void Canvas::fillWithMinimaOnly(Window* window, int k)
+{
+	auto minima = findMinima(window->lab, k);
+	for (int i = 0; i < minima->size(); i++)
+	{
+		if (!minima->at(i))
+		{
+			window->lab->l[i] = 0.0f; //Black
+			window->lab->a[i] = 0.0f;
+			window->lab->b[i] = 0.0f;
+			window->lab->luminance[i] = 0.0f;
+		}
+	}
+
+	delete minima;
+}
+/*
+Runs 'work' on a worker thread. Only one job can run at a time.
+While it runs, the worker pushes SDL events of type jobEventType:
+JOB_PROGRESS whenever the percentage of the current stage changes, and JOB_FINISHED at the end.
+The main thread must call finishJob when it gets JOB_FINISHED,
+which joins the worker and runs 'finish' with completed = false if the job was cancelled,
+or if it threw (jobError says what).
+'work' shouldn't touch any windows, SDL isn't thread safe. Do that in 'finish'.
+*/
+void Canvas::runInBackground(std::function<void()> work, std::function<void(bool completed)> finish)
+{
+	if (jobThread != nullptr)
+	{
+		cancelJob();
+		finishJob();
+	}
+
+	jobFinish = finish;
+	jobCancelled = false;
+	jobError.clear();
+	cancelRequested = false;
+	lastProgressStage = nullptr;
+	lastProgressPercent = -1;
+	jobRunning = true;
+
+	jobThread = new std::thread([this, work]()
+	{
+		try
+		{
+			work();
+		}
+		catch (DecompositionCancelled&)
+		{
+			jobCancelled = true;
+		}
+		catch (std::exception& e)
+		{
+			//Running out of memory on a big image, or a solve that didn't converge. Letting it out of the thread would end the program.
+			jobError = e.what();
+			jobCancelled = true;
+		}
+
+		SDL_Event e;
+		SDL_zero(e);
+		e.type = jobEventType;
+		e.user.code = JOB_FINISHED;
+		SDL_PushEvent(&e);
+	});
+}
+
+//Asks the job to stop. It notices at its next call to checkProgress or the solver's next iteration.
+void Canvas::cancelJob()
+{
+	cancelRequested = true;
+}
+
+/*
+Waits for the worker, then runs the job's 'finish'.
+Returns false if the job was cancelled or failed.
+*/
+bool Canvas::finishJob()
+{
+	if (jobThread == nullptr)
+		return false;
+
+	jobThread->join();
+	delete jobThread;
+	jobThread = nullptr;
+	jobRunning = false;
+
+	bool completed = !jobCancelled;
+	auto finish = jobFinish;
+	jobFinish = nullptr;
+	if (finish)
+		finish(completed);
+	return completed;
+}
+
+bool Canvas::busy()
+{
+	return jobThread != nullptr;
+}
+
+/*
+Called by the algorithms between chunks of work: 'done' out of 'total' of 'stage' is finished.
+Throws DecompositionCancelled if the job has been cancelled.
+Doesn't do anything when there's no job, so the algorithms can still be called directly.
+*/
+void Canvas::checkProgress(const char* stage, int done, int total)
+{
+	if (cancelRequested)
+		throw DecompositionCancelled();
+	postProgress(stage, done, total);
+}
+
+//Pushes a JOB_PROGRESS event if the percentage has changed. Never throws, so it's safe to call from the solver threads.
+void Canvas::postProgress(const char* stage, int done, int total)
+{
+	if (!jobRunning)
+		return;
+
+	int percent = std::max(0, std::min(100, (int)((long long)done * 100 / std::max(1, total))));
+	if (stage == lastProgressStage && percent == lastProgressPercent)
+		return;
+	lastProgressStage = stage;
+	lastProgressPercent = percent;
+
+	SDL_Event e;
+	SDL_zero(e);
+	e.type = jobEventType;
+	e.user.code = JOB_PROGRESS;
+	e.user.data1 = (void*)stage;
+	e.user.data2 = (void*)(intptr_t)percent;
+	SDL_PushEvent(&e);
+}
+
+//Windows can be closed while a job runs, so jobs check their window is still around before using it
+bool Canvas::hasWindow(Window* window)
+{
+	return std::find(windows.begin(), windows.end(), window) != windows.end();
+}
@@ -2,14 +2,242 @@
 
 #include <iostream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <cfloat>
 #include <SDL.h>
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 #include "Window.h"
+#include "FastColor.h"
+#include "Parallel.h"
+#include "Solver.h"
+#include "EdgeAwareFilter.h"
+#include "Ordering.h"
+#include "StencilMatrix.h"
+#include "FastMath.h"
+#include "Components.h"
+#include "HierarchicalBasis.h"
+#include "Scanline.h"
 
 using namespace Eigen;
 using namespace Eisel;
 
+enum InterpolationMethod
+{
+	INTERPOLATE_EXACT,			//Solve the sparse system with BiCGSTAB
+	INTERPOLATE_APPROXIMATE,	//Edge-aware normalized convolution, see Canvas::interpolateExtremaApprox
+	INTERPOLATE_RELAXED			//Solve the same system in place by successive over-relaxation, see Canvas::interpolateExtremaRelaxed
+};
+
+//The order the solver numbers the pixels in, see Ordering.h
+enum UnknownOrdering
+{
+	ORDER_ROW_MAJOR,	//Same as the image
+	ORDER_MORTON,		//Z-order curve
+	ORDER_RCM			//Reverse Cuthill-McKee
+};
+
+//How the exact solve stores its matrix
+enum MatrixFormat
+{
+	MATRIX_SPARSE,	//Eigen's SparseMatrix
+	MATRIX_STENCIL	//StencilMatrix. Only used in row major order, other orderings fall back to MATRIX_SPARSE.
+};
+
+//Which BiCGSTAB the exact solve runs
+enum SolverPath
+{
+	SOLVER_EIGEN,		//Eisel::bicgstab, Eigen's loop with one thread per channel
+	SOLVER_PARALLEL		//Eisel::parallelBicgstab, one channel at a time with every step spread over all threads
+};
+
+//What the exact solve is preconditioned with
+enum PreconditionerType
+{
+	PRECONDITION_DIAGONAL,		//A's diagonal. It's all 1, so this is the same as none.
+	PRECONDITION_HIERARCHICAL	//Eisel::HierarchicalBasis. Only used in row major order, other orderings fall back to PRECONDITION_DIAGONAL.
+};
+
+//How the stencil matrix stores its weights
+enum WeightPrecision
+{
+	WEIGHTS_FLOAT,
+	WEIGHTS_HALF	//fp16 with a scale per row, see StencilMatrix::compressWeights
+};
+
+//How the neighbor weights are computed
+enum WeightKernel
+{
+	KERNEL_REFERENCE,	//The original scalar code (Canvas::referenceWeights), with libm's exp and pow
+	KERNEL_FAST,		//Eisel::fastWeights
+	KERNEL_CHECKED		//Both, keeping the fast weights and reporting how far they were from the reference
+};
+
+const float WEIGHT_KERNEL_TOLERANCE = 1e-5f; //Biggest difference KERNEL_CHECKED accepts between a fast and a reference weight
+
+const double REFINED_TOLERANCE = 1e-10;	//Relative residual InterpolationOptions::refine solves to
+const int REFINEMENT_STEPS = 10;			//Refinement steps before giving up on REFINED_TOLERANCE
+
+const float RELAXATION_FACTOR = 1.7f;		//SOR's omega, see Canvas::relaxSweep. Fastest on the test images, 1.5 and 1.8 took up to twice the sweeps.
+const float RELAXED_TOLERANCE = 1e-5f;		//Relative residual INTERPOLATE_RELAXED stops at
+const int RELAXATION_SWEEPS = 10000;		//Sweeps before INTERPOLATE_RELAXED gives up on RELAXED_TOLERANCE
+
+//How envelopes are interpolated between the extrema. Canvas::interpolation holds the settings in use.
+struct InterpolationOptions
+{
+	InterpolationMethod method = INTERPOLATE_EXACT;
+
+	/*
+	0 uses every pixel of the k * k neighborhood.
+	Otherwise neighborhoods wider than dilatedTaps pixels only look at a dilatedTaps * dilatedTaps lattice of them,
+	spread out to cover the same area (see Canvas::neighborhoodOffsets).
+	That keeps the matrix at the same number of non-zeros per row for every k.
+	*/
+	int dilatedTaps = 0;
+
+	UnknownOrdering ordering = ORDER_ROW_MAJOR; //Only changes memory access patterns, not the result
+	MatrixFormat format = MATRIX_STENCIL; //Same, the stencil just has no column indices to read
+	SolverPath solver = SOLVER_PARALLEL;
+	PreconditionerType preconditioner = PRECONDITION_DIAGONAL;
+	WeightPrecision weights = WEIGHTS_FLOAT; //Only for MATRIX_STENCIL
+
+	/*
+	Refine the parallel solver's solution to a relative residual of REFINED_TOLERANCE with Eisel::refinedBicgstab.
+	Only for SOLVER_PARALLEL.
+	*/
+	bool refine = false;
+
+	WeightKernel kernel = KERNEL_FAST;
+
+	/*
+	Solve the parts of the system that extrema cut off from the rest on their own, see Canvas::solveComponents.
+	Not used with refine: the parts are solved in double, but only to float precision and with rows scaled differently (see below),
+	so they wouldn't meet REFINED_TOLERANCE in the whole system.
+	Off by default: the parts' rows are scaled by what their weights add up to, so the envelopes differ from the whole image solve's
+	by up to about 5e-4 (0.05 of L).
+	*/
+	bool splitComponents = false;
+};
+
+/*
+What the exact solves of the two envelopes of an image can share, see Canvas::computeEnvelope.
+The minima and maxima systems have the same size and weights. Their rows only differ where a pixel is an extremum in one and not the other,
+so the second solve patches those rows of the first one's matrix instead of building its own.
+Only for solves of the same image and k with the same InterpolationOptions.
+*/
+struct InterpolationSetup
+{
+	~InterpolationSetup() { delete stencil; }
+
+	//Forgets the image, to start on another one. The memory is kept for it.
+	void clear()
+	{
+		hasLuminance = false;
+		hasVariances = false;
+		fixed.clear();
+		ordered = false;
+	}
+
+	bool hasLuminance = false;
+	VectorXf luminance;
+	bool hasVariances = false;
+	std::vector<float> variances;		//See Canvas::neighborhoodVariances
+	StencilMatrix* stencil = nullptr;	//The last matrix solved, when it's a stencil with float weights
+	std::vector<int> fixed;				//The pixels the stencil has rows of extrema for (the extrema and whatever solveComponents solved). Empty if it has none yet.
+	bool ordered = false;				//Whether newIndex has been computed
+	std::vector<int> newIndex;			//The sparse matrix's ordering, see Canvas::computeOrdering
+};
+
+/*
+The buffers a decomposition works in, kept from one decomposition to the next so they aren't allocated again every time (see Canvas::workspace).
+Vectors only ever grow, so smaller images and neighborhoods fit in what's there.
+Eigen's matrices are reallocated when their size changes, which is only when the image size or the number of channels does.
+Only the default solve (stencil with float weights, parallel solver, diagonal preconditioner) keeps everything here.
+The other options, and the small systems solveComponents solves on their own, still allocate their own.
+*/
+struct DecompositionWorkspace
+{
+	//computeEnvelope
+	MatrixXf channels;
+	std::vector<int> minima;
+	std::vector<int> maxima;
+	MatrixXf lower;				//The minima's envelope, then their average until computeEnvelope hands it over
+	MatrixXf upper;				//The maxima's envelope
+	InterpolationSetup setup;
+
+	//interpolateExtrema
+	std::vector<int> solvedMap;	//The extrema plus what solveComponents solved
+	MatrixXf solvedValues;
+	MatrixXf b;
+
+	//solveComponents
+	DisjointSets sets;
+	std::vector<int> component;
+	std::vector<int> starts;
+	std::vector<int> pixels;
+	std::vector<int> localIndex;
+	std::vector<int> filled;
+
+	//solveChannelsParallel
+	VectorXf rhs;
+	VectorXf result;
+	BicgstabVectors solver;
+
+	long long bytes() const;	//Memory held
+	void release();				//Frees everything, for when the memory is wanted for something else
+};
+
+//How a decomposition is made to fit in Canvas::memoryBudget, see Canvas::planDecomposition
+enum DecompositionStrategy
+{
+	STRATEGY_IN_CORE,		//The whole image (or region) at once, the usual way
+	STRATEGY_MATRIX_FREE,	//The same with INTERPOLATE_RELAXED, which doesn't store a matrix
+	STRATEGY_TILED			//Tiles one after another, each decomposed with a halo like Canvas::decomposeRegion
+};
+
+const int PREFERRED_TILE_HALOS = 4;	//Tiles at least this many halos wide are picked over a matrix-free solve. Smaller ones spend most of their time on the halos.
+const int MIN_TILE_SIZE = 16;		//Tiles are never smaller than this, or than one halo
+
+struct DecompositionPlan
+{
+	DecompositionStrategy strategy = STRATEGY_IN_CORE;
+	InterpolationOptions options;	//What to decompose with. These may turn splitComponents off or switch to INTERPOLATE_RELAXED to save memory.
+	int tileSize = 0;				//Width and height of the tiles, not counting the halo. Only for STRATEGY_TILED.
+	long long peakBytes = 0;		//The most it's expected to have allocated at once, including what the caller already holds
+};
+
+//Thrown by Canvas::planDecomposition when a decomposition won't fit in the memory budget however it's done
+class DecompositionTooLarge : public std::runtime_error
+{
+public:
+	DecompositionTooLarge(const std::string& message) : std::runtime_error(message) {}
+};
+
+//Thrown on the worker thread when a background job is cancelled. runInBackground catches it.
+class DecompositionCancelled : public std::runtime_error
+{
+public:
+	DecompositionCancelled() : std::runtime_error("Decomposition cancelled") {}
+};
+
+//Thrown when a solve stops without converging, which BiCGSTAB can on a nearly singular system. runInBackground reports it like any other error.
+class DecompositionFailed : public std::runtime_error
+{
+public:
+	DecompositionFailed(const std::string& message) : std::runtime_error(message) {}
+};
+
+//user.code of the SDL events a background job pushes, see runInBackground
+enum JobEventCode
+{
+	JOB_PROGRESS,	//data1 is the stage name (const char*), data2 is the percentage (intptr_t)
+	JOB_FINISHED	//Call finishJob
+};
+
 class Canvas
 {
 public:
@@ -20,16 +248,84 @@ public:
 	void renderAll();
 	void handleEvent(SDL_Event& e);
 
-	Window* runMultiDecomp(Window* base, int k);
-	void reconstructFromDecomps(Window* base, Window* overlay);
-	std::vector<int>* findMaxima(Window* base, int k);
-	std::vector<int>* findMinima(Window* base, int k);
-	VectorXf interpolateExtrema(Window* base, int k, std::vector<int>* extremaMap);
+	Window* runMultiDecomp(Window* base, int k, bool fullColor = false);
+	void runMultiDecompInBackground(Window* base, int k, bool fullColor = false, const SDL_Rect* region = nullptr);
+	void decomposeRegion(LabImage* image, SDL_Rect region, int k, bool fullColor, int halo, LabImage* residual, LabImage* detailLab, LabImage* detailLayer);
+	int defaultHalo(int k);
+	MatrixXf computeEnvelope(LabImage* image, int k, bool fullColor = false);
+	void computeEnvelope(LabImage* image, int k, bool fullColor, MatrixXf& envelope);
+	long long estimateEnvelopeBytes(int width, int height, int k, bool fullColor, const InterpolationOptions& options);
+	DecompositionPlan planDecomposition(int width, int height, const SDL_Rect* region, int k, bool fullColor, long long resident);
+	void printPlan(const DecompositionPlan& plan, int k);
+	void decomposePlanned(LabImage* image, const SDL_Rect* region, int k, bool fullColor, const DecompositionPlan& plan, LabImage* residual, LabImage* detailLab, LabImage* detailLayer);
+	void reconstructFromDecomps(Window* base, Window* overlay, bool fullColor = false, float detailGain = 1.0f);
+	void recompose(LabImage* output, std::vector<LabImage*>& layers, std::vector<float>& gains);
+	void recomposeToPixels(std::vector<LabImage*>& layers, std::vector<float>& gains, Uint32* pixels, int pitch);
+	void recomposeRow(std::vector<LabImage*>& layers, std::vector<float>& gains, int y, float* l, float* a, float* b);
+	std::vector<int> neighborhoodOffsets(int k);
+	static std::vector<int> neighborhoodOffsets(int k, int dilatedTaps);
+	int extremaRank(int k);
+	std::vector<int>* findMaxima(LabImage* base, int k);
+	std::vector<int>* findMinima(LabImage* base, int k);
+	void findMaxima(LabImage* base, int k, std::vector<int>& maxima);
+	void findMinima(LabImage* base, int k, std::vector<int>& minima);
+	void findExtrema(LabImage* base, int k, std::vector<int>* minima, std::vector<int>* maxima);
+	VectorXf computeLuminance(LabImage* base);
+	void computeLuminance(LabImage* base, VectorXf& luminance);
+	MatrixXf computeColorChannels(LabImage* base);
+	void computeChannels(LabImage* base, bool fullColor, MatrixXf& channels);
+	void computeNeighborhoodVariances(LabImage* base, std::vector<int>& offsets, VectorXf& luminance, std::vector<float>& variances);
+	const float* neighborhoodVariances(LabImage* base, std::vector<int>& offsets, VectorXf& luminance, InterpolationSetup* setup, std::vector<float>& own);
+	void computeNeighborWeights(LabImage* base, int x, int y, std::vector<int>& offsets, VectorXf& luminance, std::vector<int>& taps, std::vector<float>& weights,
+		const float* variances = nullptr);
+	void referenceWeights(std::vector<float>& values, float center);
+	void reportKernelDifference();
+	void buildInterpolationMatrix(LabImage* base, int k, std::vector<int>* extremaMap, VectorXf& luminance, SparseColumns& A, InterpolationSetup* setup = nullptr);
+	void buildStencilMatrix(LabImage* base, int k, std::vector<int>* extremaMap, VectorXf& luminance, StencilMatrix& A, const std::vector<int>* built = nullptr,
+		InterpolationSetup* setup = nullptr);
+	bool solveComponents(LabImage* base, int k, std::vector<int>* extremaMap, VectorXf& luminance, MatrixXf& channels, std::vector<int>& fixed, MatrixXf& values,
+		DecompositionWorkspace& workspace);
+	VectorXf interpolateExtrema(LabImage* base, int k, std::vector<int>* extremaMap);
+	MatrixXf interpolateExtrema(LabImage* base, int k, std::vector<int>* extremaMap, MatrixXf& channels);
+	void interpolateExtrema(LabImage* base, int k, std::vector<int>* extremaMap, MatrixXf& channels, MatrixXf& x, DecompositionWorkspace* workspace);
+	template<typename MatrixType, typename Preconditioner>
+	MatrixXf solveChannels(const MatrixType& A, const Preconditioner& preconditioner, MatrixXf& b); //Defined in Canvas.cpp, only used there
+	void solveChannelsParallel(const Eisel::MatrixProduct& multiply, const Eisel::DoubleMatrixProduct& multiplyDouble, const float* inverseDiagonal, MatrixXf& b, MatrixXf& x,
+		const Eisel::MatrixProduct& precondition = Eisel::MatrixProduct(), DecompositionWorkspace* workspace = nullptr);
+	std::string solveFailure(int channel, int iterations, float residual);
+	HierarchicalBasis* buildHierarchicalBasis(LabImage* base, std::vector<int>* extremaMap, const HierarchicalBasis::RowAccess& rows);
+	void comparePreconditioners(LabImage* image, int k);
+	void computeOrdering(LabImage* base, UnknownOrdering ordering, SparseColumns& A, std::vector<int>& newIndex);
+	void benchmarkOrderings(LabImage* image, int k);
+	MatrixXf interpolateExtremaApprox(LabImage* base, int k, std::vector<int>* extremaMap, MatrixXf& channels);
+	int relaxationColors(std::vector<int>& offsets);
+	double relaxSweep(LabImage* base, std::vector<int>& offsets, int colors, VectorXf& luminance, std::vector<int>* extremaMap, MatrixXf& values, float omega,
+		int& unknown, const MatrixXf* rhs = nullptr);
+	MatrixXf interpolateExtremaRelaxed(LabImage* base, int k, std::vector<int>* extremaMap, MatrixXf& channels);
+	void compareInterpolation(LabImage* image, int k);
+
+	std::vector<DecompositionPlan> planEnhancement(int width, int height, int k, int levels, bool fullColor);
+	void computeEnhanceLayers(LabImage* image, int k, bool fullColor, const std::vector<DecompositionPlan>& plans, std::vector<LabImage*>& layers);
+	void startEnhancing(Window* window, int k, int levels, bool fullColor = false);
+	void startEnhancingInBackground(Window* window, int k, int levels, bool fullColor = false);
+	void stopEnhancing(bool keepResult = true);
+	void showEnhancement();
 
 	void fillWithMultiDecompResidual(Window*, VectorXf* multiDecompValues);
+	void fillWithMultiDecompResidual(Window*, MatrixXf* multiDecompValues);
 	void fillWithMultiDecompDetail(Window*, VectorXf* multiDecompValues);
+	void fillWithMultiDecompDetail(Window*, MatrixXf* multiDecompValues);
+	void fillWithMultiDecompLayers(LabImage* source, LabImage* residualLab, LabImage* detailLab, LabImage* detailLayer, MatrixXf* multiDecompValues);
 	void fillWithMaximaOnly(Window* window, int k);
 	void fillWithMinimaOnly(Window* window, int k);
+
+	void runInBackground(std::function<void()> work, std::function<void(bool completed)> finish);
+	void cancelJob();
+	bool finishJob();
+	bool busy();
+	void checkProgress(const char* stage, int done, int total);
+	void postProgress(const char* stage, int done, int total);
+	bool hasWindow(Window* window);
 	
 	int width;
 	int height;
@@ -38,6 +334,28 @@ public:
 	std::vector<Window*> windows;
 	int nextWindowPos = 50;
 
-	Uint32* sourceImageU32;	//This is the format SDL uses internally.
-							//Eisel.cpp has helper functions toRGB and toLAB that can convert to RGB and LAB color.
+	LabImage* sourceImage;	//Converted to LAB once when the image is loaded.
+							//Windows convert back to SDL's format themselves when they're displayed.
+
+	InterpolationOptions interpolation;
+	DecompositionWorkspace workspace;	//Only one decomposition runs at a time, see computeEnvelope
+	long long memoryBudget;				//Bytes a decomposition may allocate, see planDecomposition. Half the RAM by default.
+
+	//Detail enhancement, see startEnhancing
+	Window* enhanceWindow = nullptr;		//nullptr when not enhancing
+	std::vector<LabImage*> enhanceLayers;	//[0] is the coarse layer, then detail layers from finest to coarsest
+	std::vector<float> enhanceGains;		//One per layer
+
+	//Background jobs, see runInBackground
+	Uint32 jobEventType;					//SDL event type for JobEventCode events
+	std::thread* jobThread = nullptr;
+	std::function<void(bool)> jobFinish;	//Runs on the main thread once the job is done or cancelled
+	std::atomic<bool> jobRunning;
+	std::atomic<bool> cancelRequested;
+	bool jobCancelled = false;
+	std::string jobError;					//What the job threw if it failed, empty otherwise
+	const char* lastProgressStage = nullptr;	//Only touched by whichever thread is reporting progress,
+	int lastProgressPercent = -1;				//so events are only pushed when the percentage changes
+
+	std::atomic<float> kernelDifference;	//Biggest difference KERNEL_CHECKED has seen, see reportKernelDifference
 };
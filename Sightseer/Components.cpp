@@ -0,0 +1,104 @@
+#include "Components.h"
+
+namespace Eisel
+{
+	DisjointSets::DisjointSets(int count)
+	{
+		reset(count);
+	}
+
+	void DisjointSets::reset(int count)
+	{
+		parent.resize(count);
+		size.assign(count, 1);
+		for (int i = 0; i < count; i++)
+		{
+			parent[i] = i;
+		}
+	}
+
+	int DisjointSets::find(int element)
+	{
+		while (parent[element] != element)
+		{
+			parent[element] = parent[parent[element]]; //Path halving: every other element skips up a level
+			element = parent[element];
+		}
+		return element;
+	}
+
+	void DisjointSets::unite(int a, int b)
+	{
+		a = find(a);
+		b = find(b);
+		if (a == b)
+			return;
+
+		if (size[a] < size[b])
+			std::swap(a, b);
+		parent[b] = a;
+		size[a] += size[b];
+	}
+
+	int findComponents(int width, int height, const std::vector<int>& offsets, const std::vector<int>& fixed, std::vector<int>& component,
+		DisjointSets* sets)
+	{
+		int res = width * height;
+
+		//Neighborhoods are symmetric, so each pair only has to be joined once: through the neighbors that come after the pixel
+		std::vector<int> forwardX, forwardY;
+		for (int offsetY : offsets)
+		{
+			for (int offsetX : offsets)
+			{
+				if (offsetY > 0 || (offsetY == 0 && offsetX > 0))
+				{
+					forwardX.push_back(offsetX);
+					forwardY.push_back(offsetY);
+				}
+			}
+		}
+
+		DisjointSets ownSets;
+		if (sets == nullptr)
+			sets = &ownSets;
+		sets->reset(res);
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int pixel = y * width + x;
+				if (fixed[pixel])
+					continue;
+
+				for (int tap = 0; tap < forwardX.size(); tap++)
+				{
+					int neighborX = x + forwardX[tap];
+					int neighborY = y + forwardY[tap];
+					if (neighborX >= 0 && neighborX < width && neighborY < height && !fixed[neighborY * width + neighborX])
+					{
+						sets->unite(pixel, neighborY * width + neighborX);
+					}
+				}
+			}
+		}
+
+		/*
+		Number the roots in the order they're first reached.
+		A root is a free pixel itself, so its own entry holds its number from then on, even before the loop gets to it.
+		*/
+		component.assign(res, -1);
+		int count = 0;
+		for (int pixel = 0; pixel < res; pixel++)
+		{
+			if (fixed[pixel])
+				continue;
+
+			int root = sets->find(pixel);
+			if (component[root] < 0)
+				component[root] = count++;
+			component[pixel] = component[root];
+		}
+		return count;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+/*
+Connected components of the interpolation system.
+
+Only the pixels that aren't extrema are solved for. Two of them are connected if one is in the other's neighborhood,
+which is when their rows of the matrix share a non-zero. Extrema have fixed values, so they don't connect anything:
+a closed band of them (a flat or saturated area, the background of a scanned page) cuts the system
+into separate smaller ones that can be solved on their own.
+*/
+
+namespace Eisel
+{
+	/*
+	Union-find over the pixels, with path halving and union by size.
+	*/
+	class DisjointSets
+	{
+	public:
+		DisjointSets(int count = 0);
+
+		void reset(int count); //Back to 'count' sets of one element each, reusing the memory
+		int find(int element);
+		void unite(int a, int b);
+		long long bytes() const { return (long long)(parent.capacity() + size.capacity()) * sizeof(int); } //Memory held
+
+	private:
+		std::vector<int> parent;
+		std::vector<int> size; //Only meaningful for roots
+	};
+
+	/*
+	@params
+	offsets		the neighborhood offsets along each axis, see Canvas::neighborhoodOffsets
+	fixed		one flag per pixel, non-zero for the pixels that aren't solved for (the extrema)
+	component	gets the component of every free pixel, numbered from 0 in the order their first pixels come in, and -1 for fixed pixels
+	sets		the union-find to use, or nullptr for one of its own
+	@returns	the number of components
+	*/
+	int findComponents(int width, int height, const std::vector<int>& offsets, const std::vector<int>& fixed, std::vector<int>& component,
+		DisjointSets* sets = nullptr);
+}
@@ -0,0 +1,152 @@
+#include "EdgeAwareFilter.h"
+
+namespace Eisel
+{
+	void boxFilter(const float* in, float* out, int width, int height, int radius)
+	{
+		std::vector<float> horizontal(width * height);
+
+		//Rows: slide a window of 2 * radius + 1 pixels along each row
+		parallelFor(0, height, [&](int firstRow, int lastRow)
+		{
+			for (int y = firstRow; y < lastRow; y++)
+			{
+				const float* row = in + y * width;
+				float* result = horizontal.data() + y * width;
+				double sum = 0.0;
+				int count = 0;
+				for (int x = 0; x < std::min(radius, width); x++)
+				{
+					sum += row[x];
+					count++;
+				}
+				for (int x = 0; x < width; x++)
+				{
+					if (x + radius < width)
+					{
+						sum += row[x + radius];
+						count++;
+					}
+					if (x - radius - 1 >= 0)
+					{
+						sum -= row[x - radius - 1];
+						count--;
+					}
+					result[x] = (float)(sum / count);
+				}
+			}
+		});
+
+		//Columns: same thing going down, a block of columns per thread so every row is read in order
+		parallelFor(0, width, [&](int firstColumn, int lastColumn)
+		{
+			int columns = lastColumn - firstColumn;
+			std::vector<double> sums(columns, 0.0);
+			int count = 0;
+			for (int y = 0; y < std::min(radius, height); y++)
+			{
+				for (int x = 0; x < columns; x++)
+				{
+					sums[x] += horizontal[y * width + firstColumn + x];
+				}
+				count++;
+			}
+			for (int y = 0; y < height; y++)
+			{
+				if (y + radius < height)
+				{
+					for (int x = 0; x < columns; x++)
+					{
+						sums[x] += horizontal[(y + radius) * width + firstColumn + x];
+					}
+					count++;
+				}
+				if (y - radius - 1 >= 0)
+				{
+					for (int x = 0; x < columns; x++)
+					{
+						sums[x] -= horizontal[(y - radius - 1) * width + firstColumn + x];
+					}
+					count--;
+				}
+				for (int x = 0; x < columns; x++)
+				{
+					out[y * width + firstColumn + x] = (float)(sums[x] / count);
+				}
+			}
+		}, 16);
+	}
+
+	void domainTransformFilter(std::vector<float*>& planes, const float* distX, const float* distY, int width, int height, float sigmaS, int iterations)
+	{
+		int res = width * height;
+		std::vector<float> weightX(res);
+		std::vector<float> weightY(res);
+
+		for (int i = 0; i < iterations; i++)
+		{
+			/*
+			Each iteration uses a smaller sigma, chosen so that all of them together
+			add up to a filter with a standard deviation of sigmaS (equation 14 in the paper).
+			A pixel 'dist' away gets weight a^dist.
+			*/
+			float sigma = sigmaS * std::sqrt(3.0f) * std::pow(2.0f, (float)(iterations - i - 1)) / std::sqrt(std::pow(4.0f, (float)iterations) - 1.0f);
+			float logA = -std::sqrt(2.0f) / sigma;
+
+			parallelFor(0, height, [&](int firstRow, int lastRow)
+			{
+				for (int j = firstRow * width; j < lastRow * width; j++)
+				{
+					weightX[j] = std::exp(distX[j] * logA);
+					weightY[j] = std::exp(distY[j] * logA);
+				}
+			});
+
+			for (auto plane : planes)
+			{
+				//Left to right, then right to left
+				parallelFor(0, height, [&](int firstRow, int lastRow)
+				{
+					for (int y = firstRow; y < lastRow; y++)
+					{
+						float* row = plane + y * width;
+						const float* weights = weightX.data() + y * width;
+						for (int x = 1; x < width; x++)
+						{
+							row[x] += weights[x] * (row[x - 1] - row[x]);
+						}
+						for (int x = width - 2; x >= 0; x--)
+						{
+							row[x] += weights[x + 1] * (row[x + 1] - row[x]);
+						}
+					}
+				});
+
+				//Top to bottom, then bottom to top. Each thread takes a block of columns and walks down it a row at a time.
+				parallelFor(0, width, [&](int firstColumn, int lastColumn)
+				{
+					for (int y = 1; y < height; y++)
+					{
+						float* row = plane + y * width;
+						const float* above = row - width;
+						const float* weights = weightY.data() + y * width;
+						for (int x = firstColumn; x < lastColumn; x++)
+						{
+							row[x] += weights[x] * (above[x] - row[x]);
+						}
+					}
+					for (int y = height - 2; y >= 0; y--)
+					{
+						float* row = plane + y * width;
+						const float* below = row + width;
+						const float* weights = weightY.data() + (y + 1) * width;
+						for (int x = firstColumn; x < lastColumn; x++)
+						{
+							row[x] += weights[x] * (below[x] - row[x]);
+						}
+					}
+				}, 16);
+			}
+		}
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include "Parallel.h"
+
+/*
+Cheap image filters used by the approximate envelope mode (see Canvas::interpolateExtremaApprox).
+
+All of these run in a fixed number of passes over the image no matter how big the neighborhood is,
+so they cost the same for k = 5 as for k = 51.
+Images are single float planes, 'width' floats per row.
+*/
+
+namespace Eisel
+{
+	/*
+	Averages every pixel with the (2 * radius + 1)^2 pixels around it, using running sums.
+	Pixels outside the image are left out of the average, so the edges aren't darkened.
+	'in' and 'out' may be the same plane.
+	*/
+	void boxFilter(const float* in, float* out, int width, int height, int radius);
+
+	/*
+	Edge-aware smoothing with the recursive filter from Gastal and Oliveira's
+	"Domain Transform for Edge-Aware Image and Video Processing" (2011).
+
+	distX[i] is the distance between pixel i and the pixel to its left, distY[i] between pixel i and the pixel above it.
+	They're 1 for identical pixels and grow across edges. A pixel barely influences anything across a long distance.
+	Each iteration runs a left-right, right-left, top-down and bottom-up pass over every plane.
+	3 iterations is what the paper recommends.
+	All the planes are filtered with the same distances, so filtering several at once only computes the weights once.
+	*/
+	void domainTransformFilter(std::vector<float*>& planes, const float* distX, const float* distY, int width, int height, float sigmaS, int iterations = 3);
+}
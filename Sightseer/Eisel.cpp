@@ -139,7 +139,12 @@ namespace Eisel
 	ColorRGB toRGB(Uint32 color)
 	{
 		ColorRGB rgb;
-		SDL_GetRGB(color, PIXEL_FORMAT, &rgb.r, &rgb.g, &rgb.b);
+		switch (PIXEL_FORMAT->format)
+		{
+		case SDL_PIXELFORMAT_ARGB8888:	FormatARGB8888::unpack(color, rgb.r, rgb.g, rgb.b); break;
+		case SDL_PIXELFORMAT_RGB888:	FormatRGB888::unpack(color, rgb.r, rgb.g, rgb.b); break;
+		default:						FormatSDL::unpack(color, rgb.r, rgb.g, rgb.b); break;
+		}
 		return rgb;
 	}
 	
@@ -220,7 +225,12 @@ namespace Eisel
 
 	Uint32 toSDL(ColorRGB colorRgb)
 	{
-		return SDL_MapRGB(PIXEL_FORMAT, colorRgb.r, colorRgb.g, colorRgb.b);
+		switch (PIXEL_FORMAT->format)
+		{
+		case SDL_PIXELFORMAT_ARGB8888:	return FormatARGB8888::pack(colorRgb.r, colorRgb.g, colorRgb.b);
+		case SDL_PIXELFORMAT_RGB888:	return FormatRGB888::pack(colorRgb.r, colorRgb.g, colorRgb.b);
+		default:						return FormatSDL::pack(colorRgb.r, colorRgb.g, colorRgb.b);
+		}
 	}
 
 	Uint32 toSDL(ColorLAB colorLab)
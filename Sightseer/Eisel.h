@@ -83,6 +83,37 @@ namespace Eisel
 		void clampAll() { clampL(); clampAB(); }
 	};
 
+	/*
+	Pixel layouts with every channel at a fixed position,
+	so packing and unpacking is just shifts and masks the compiler can inline and vectorize.
+	SDL_GetRGB and SDL_MapRGB handle any format, but they're a function call through PIXEL_FORMAT for every pixel.
+	*/
+	template <int RShift, int GShift, int BShift, Uint32 AMask>
+	struct PackedFormat
+	{
+		static inline void unpack(Uint32 pixel, Uint8& r, Uint8& g, Uint8& b)
+		{
+			r = (Uint8)(pixel >> RShift);
+			g = (Uint8)(pixel >> GShift);
+			b = (Uint8)(pixel >> BShift);
+		}
+
+		static inline Uint32 pack(Uint8 r, Uint8 g, Uint8 b)
+		{
+			return ((Uint32)r << RShift) | ((Uint32)g << GShift) | ((Uint32)b << BShift) | AMask; //Same as SDL_MapRGB: opaque if there's an alpha channel
+		}
+	};
+
+	typedef PackedFormat<16, 8, 0, 0xFF000000> FormatARGB8888;	//What every texture in Window uses
+	typedef PackedFormat<16, 8, 0, 0> FormatRGB888;				//What window surfaces usually are. Same layout, no alpha.
+
+	//Anything else goes through SDL
+	struct FormatSDL
+	{
+		static inline void unpack(Uint32 pixel, Uint8& r, Uint8& g, Uint8& b) { SDL_GetRGB(pixel, PIXEL_FORMAT, &r, &g, &b); }
+		static inline Uint32 pack(Uint8 r, Uint8 g, Uint8 b) { return SDL_MapRGB(PIXEL_FORMAT, r, g, b); }
+	};
+
 	float increaseContrast100(float luminance);
 	float increaseContrast1(float luminance);
 	float ntscLuminance(ColorRGB colorRgb);
@@ -0,0 +1,301 @@
+#include "FastColor.h"
+
+namespace Eisel
+{
+	float SRGB_TO_LINEAR[256];
+	float LINEAR_TO_SRGB[LINEAR_TO_SRGB_SIZE + 2];
+
+	static bool fillTables()
+	{
+		//Both tables are filled with the exact formulas from toXYZ(ColorRGB) and toRGB(ColorXYZ)
+		for (int i = 0; i < 256; i++)
+		{
+			double value = i / 255.0;
+			if (value > 0.04045)	value = pow((value + 0.055) / 1.055, 2.4);
+			else					value = value / 12.92;
+			SRGB_TO_LINEAR[i] = (float)value;
+		}
+
+		for (int i = 0; i < LINEAR_TO_SRGB_SIZE + 2; i++)
+		{
+			double value = std::min(1.0, (double)i / LINEAR_TO_SRGB_SIZE);
+			if (value > 0.0031308)	value = 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+			else					value = 12.92 * value;
+			LINEAR_TO_SRGB[i] = (float)(value * 255.0);
+		}
+		return true;
+	}
+
+	static bool tablesFilled = fillTables();
+
+	float fastCbrt(float x)
+	{
+		/*
+		Dividing the exponent bits by 3 gets us within a few percent of the cube root.
+		Each Newton step then squares the relative error, so 3 steps is plenty for a float.
+		Only meant for x > 0.
+		*/
+		union { float f; Uint32 i; } bits;
+		bits.f = x;
+		bits.i = bits.i / 3 + 709921077;
+		float y = bits.f;
+		y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+		y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+		y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+		return y;
+	}
+
+	float linearToSRGB(float linear)
+	{
+		linear = clamp(linear, 0.0f, 1.0f) * LINEAR_TO_SRGB_SIZE;
+		int index = (int)linear;
+		float fraction = linear - index;
+		return LINEAR_TO_SRGB[index] + (LINEAR_TO_SRGB[index + 1] - LINEAR_TO_SRGB[index]) * fraction;
+	}
+
+	//Same steps as toLAB(Uint32), in float
+	template <class Format>
+	static inline void pixelToLAB(Uint32 pixel, float& l, float& a, float& b)
+	{
+		Uint8 r8, g8, b8;
+		Format::unpack(pixel, r8, g8, b8);
+		float r = SRGB_TO_LINEAR[r8] * 100.0f;
+		float g = SRGB_TO_LINEAR[g8] * 100.0f;
+		float bl = SRGB_TO_LINEAR[b8] * 100.0f;
+
+		float x = clamp(r * 0.4124f + g * 0.3576f + bl * 0.1805f, 0.0f, (float)refWhiteX) / (float)refWhiteX;
+		float y = clamp(r * 0.2126f + g * 0.7152f + bl * 0.0722f, 0.0f, (float)refWhiteY) / (float)refWhiteY;
+		float z = clamp(r * 0.0193f + g * 0.1192f + bl * 0.9505f, 0.0f, (float)refWhiteZ) / (float)refWhiteZ;
+
+		x = x > 0.008856f ? fastCbrt(x) : 7.787f * x + 16.0f / 116.0f;
+		y = y > 0.008856f ? fastCbrt(y) : 7.787f * y + 16.0f / 116.0f;
+		z = z > 0.008856f ? fastCbrt(z) : 7.787f * z + 16.0f / 116.0f;
+
+		l = clamp(116.0f * y - 16.0f, 0.0f, 100.0f);
+		a = clamp(500.0f * (x - y), -128.0f, 128.0f);
+		b = clamp(200.0f * (y - z), -128.0f, 128.0f);
+	}
+
+	//Same steps as toSDL(ColorLAB), in float, up to the sRGB values in [0, 255] it truncates
+	static inline void labToSRGB(float l, float a, float b, float& red, float& green, float& blue)
+	{
+		l = clamp(l, 0.0f, 100.0f);
+		a = clamp(a, -128.0f, 128.0f);
+		b = clamp(b, -128.0f, 128.0f);
+
+		float fy = (l + 16.0f) / 116.0f;
+		float fx = a / 500.0f + fy;
+		float fz = fy - b / 200.0f;
+
+		float x = fx * fx * fx > 0.008856f ? fx * fx * fx : (fx - 16.0f / 116.0f) / 7.787f;
+		float y = l > (float)(KAPPA * EPSILON) ? fy * fy * fy : l / (float)KAPPA;
+		float z = fz * fz * fz > 0.008856f ? fz * fz * fz : (fz - 16.0f / 116.0f) / 7.787f;
+
+		x = clamp(x * (float)refWhiteX, 0.0f, (float)refWhiteX) / 100.0f;
+		y = clamp(y * (float)refWhiteY, 0.0f, (float)refWhiteY) / 100.0f;
+		z = clamp(z * (float)refWhiteZ, 0.0f, (float)refWhiteZ) / 100.0f;
+
+		red = linearToSRGB(x *  3.2406f + y * -1.5372f + z * -0.4986f);
+		green = linearToSRGB(x * -0.9689f + y *  1.8758f + z *  0.0415f);
+		blue = linearToSRGB(x *  0.0557f + y * -0.2040f + z *  1.0570f);
+	}
+
+	template <class Format>
+	static inline Uint32 pixelFromLAB(float l, float a, float b)
+	{
+		float r, g, bl;
+		labToSRGB(l, a, b, r, g, bl);
+		return Format::pack((Uint8)r, (Uint8)g, (Uint8)bl);
+	}
+
+#ifdef EISEL_SSE2
+	static inline __m128 select(__m128 mask, __m128 ifTrue, __m128 ifFalse)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse));
+	}
+
+	static inline __m128 clamp(__m128 value, float minimum, float maximum)
+	{
+		return _mm_min_ps(_mm_set1_ps(maximum), _mm_max_ps(_mm_set1_ps(minimum), value));
+	}
+
+	static inline __m128 cbrt4(__m128 x)
+	{
+		//Same as fastCbrt. SSE2 can't divide integers, so the exponent trick is done in float.
+		__m128i bits = _mm_castps_si128(x);
+		bits = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(bits), _mm_set1_ps(1.0f / 3.0f)));
+		__m128 y = _mm_castsi128_ps(_mm_add_epi32(bits, _mm_set1_epi32(709921077)));
+		__m128 two = _mm_set1_ps(2.0f);
+		__m128 third = _mm_set1_ps(1.0f / 3.0f);
+		for (int i = 0; i < 3; i++)
+		{
+			y = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(two, y), _mm_div_ps(x, _mm_mul_ps(y, y))), third);
+		}
+		return y;
+	}
+
+	static inline __m128 labCurve4(__m128 v)
+	{
+		__m128 linear = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(7.787f), v), _mm_set1_ps(16.0f / 116.0f));
+		return select(_mm_cmpgt_ps(v, _mm_set1_ps(0.008856f)), cbrt4(v), linear);
+	}
+#endif
+
+	template <class Format>
+	static void rowToLABAs(const Uint32* pixels, float* l, float* a, float* b, int count)
+	{
+		int i = 0;
+#ifdef EISEL_SSE2
+		for (; i + 4 <= count; i += 4)
+		{
+			//The table lookups are scalar, everything after them is 4 pixels at a time
+			float rl[4], gl[4], bll[4];
+			for (int j = 0; j < 4; j++)
+			{
+				Uint8 r8, g8, b8;
+				Format::unpack(pixels[i + j], r8, g8, b8);
+				rl[j] = SRGB_TO_LINEAR[r8];
+				gl[j] = SRGB_TO_LINEAR[g8];
+				bll[j] = SRGB_TO_LINEAR[b8];
+			}
+			__m128 r = _mm_loadu_ps(rl);
+			__m128 g = _mm_loadu_ps(gl);
+			__m128 bl = _mm_loadu_ps(bll);
+			__m128 hundred = _mm_set1_ps(100.0f);
+			r = _mm_mul_ps(r, hundred);
+			g = _mm_mul_ps(g, hundred);
+			bl = _mm_mul_ps(bl, hundred);
+
+			__m128 x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.4124f)), _mm_mul_ps(g, _mm_set1_ps(0.3576f))), _mm_mul_ps(bl, _mm_set1_ps(0.1805f)));
+			__m128 y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))), _mm_mul_ps(bl, _mm_set1_ps(0.0722f)));
+			__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.0193f)), _mm_mul_ps(g, _mm_set1_ps(0.1192f))), _mm_mul_ps(bl, _mm_set1_ps(0.9505f)));
+			x = _mm_div_ps(clamp(x, 0.0f, (float)refWhiteX), _mm_set1_ps((float)refWhiteX));
+			y = _mm_div_ps(clamp(y, 0.0f, (float)refWhiteY), _mm_set1_ps((float)refWhiteY));
+			z = _mm_div_ps(clamp(z, 0.0f, (float)refWhiteZ), _mm_set1_ps((float)refWhiteZ));
+
+			x = labCurve4(x);
+			y = labCurve4(y);
+			z = labCurve4(z);
+
+			_mm_storeu_ps(l + i, clamp(_mm_sub_ps(_mm_mul_ps(_mm_set1_ps(116.0f), y), _mm_set1_ps(16.0f)), 0.0f, 100.0f));
+			_mm_storeu_ps(a + i, clamp(_mm_mul_ps(_mm_set1_ps(500.0f), _mm_sub_ps(x, y)), -128.0f, 128.0f));
+			_mm_storeu_ps(b + i, clamp(_mm_mul_ps(_mm_set1_ps(200.0f), _mm_sub_ps(y, z)), -128.0f, 128.0f));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			pixelToLAB<Format>(pixels[i], l[i], a[i], b[i]);
+		}
+	}
+
+	template <class Format>
+	static void rowFromLABAs(const float* l, const float* a, const float* b, Uint32* pixels, int count)
+	{
+		int i = 0;
+#ifdef EISEL_SSE2
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 lv = clamp(_mm_loadu_ps(l + i), 0.0f, 100.0f);
+			__m128 av = clamp(_mm_loadu_ps(a + i), -128.0f, 128.0f);
+			__m128 bv = clamp(_mm_loadu_ps(b + i), -128.0f, 128.0f);
+
+			__m128 fy = _mm_div_ps(_mm_add_ps(lv, _mm_set1_ps(16.0f)), _mm_set1_ps(116.0f));
+			__m128 fx = _mm_add_ps(_mm_div_ps(av, _mm_set1_ps(500.0f)), fy);
+			__m128 fz = _mm_sub_ps(fy, _mm_div_ps(bv, _mm_set1_ps(200.0f)));
+
+			__m128 offset = _mm_set1_ps(16.0f / 116.0f);
+			__m128 slope = _mm_set1_ps(7.787f);
+			__m128 epsilon = _mm_set1_ps(0.008856f);
+			__m128 fx3 = _mm_mul_ps(_mm_mul_ps(fx, fx), fx);
+			__m128 fz3 = _mm_mul_ps(_mm_mul_ps(fz, fz), fz);
+			__m128 x = select(_mm_cmpgt_ps(fx3, epsilon), fx3, _mm_div_ps(_mm_sub_ps(fx, offset), slope));
+			__m128 y = select(_mm_cmpgt_ps(lv, _mm_set1_ps((float)(KAPPA * EPSILON))), _mm_mul_ps(_mm_mul_ps(fy, fy), fy), _mm_div_ps(lv, _mm_set1_ps((float)KAPPA)));
+			__m128 z = select(_mm_cmpgt_ps(fz3, epsilon), fz3, _mm_div_ps(_mm_sub_ps(fz, offset), slope));
+
+			__m128 hundredth = _mm_set1_ps(0.01f);
+			x = _mm_mul_ps(clamp(_mm_mul_ps(x, _mm_set1_ps((float)refWhiteX)), 0.0f, (float)refWhiteX), hundredth);
+			y = _mm_mul_ps(clamp(_mm_mul_ps(y, _mm_set1_ps((float)refWhiteY)), 0.0f, (float)refWhiteY), hundredth);
+			z = _mm_mul_ps(clamp(_mm_mul_ps(z, _mm_set1_ps((float)refWhiteZ)), 0.0f, (float)refWhiteZ), hundredth);
+
+			float r[4], g[4], bl[4];
+			_mm_storeu_ps(r, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(3.2406f)), _mm_mul_ps(y, _mm_set1_ps(-1.5372f))), _mm_mul_ps(z, _mm_set1_ps(-0.4986f))));
+			_mm_storeu_ps(g, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(-0.9689f)), _mm_mul_ps(y, _mm_set1_ps(1.8758f))), _mm_mul_ps(z, _mm_set1_ps(0.0415f))));
+			_mm_storeu_ps(bl, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(0.0557f)), _mm_mul_ps(y, _mm_set1_ps(-0.2040f))), _mm_mul_ps(z, _mm_set1_ps(1.0570f))));
+
+			for (int j = 0; j < 4; j++)
+			{
+				pixels[i + j] = Format::pack((Uint8)linearToSRGB(r[j]), (Uint8)linearToSRGB(g[j]), (Uint8)linearToSRGB(bl[j]));
+			}
+		}
+#endif
+		for (; i < count; i++)
+		{
+			pixels[i] = pixelFromLAB<Format>(l[i], a[i], b[i]);
+		}
+	}
+
+	/*
+	Converts 'count' packed pixels into planar L, a and b.
+	Equivalent to calling toLAB(Uint32) on every pixel.
+	The format is checked once per row, not once per pixel.
+	*/
+	void rowToLAB(const Uint32* pixels, float* l, float* a, float* b, int count)
+	{
+		switch (PIXEL_FORMAT->format)
+		{
+		case SDL_PIXELFORMAT_ARGB8888:	rowToLABAs<FormatARGB8888>(pixels, l, a, b, count); break;
+		case SDL_PIXELFORMAT_RGB888:	rowToLABAs<FormatRGB888>(pixels, l, a, b, count); break;
+		default:						rowToLABAs<FormatSDL>(pixels, l, a, b, count); break;
+		}
+	}
+
+	/*
+	Converts planar L, a and b back into 'count' packed pixels.
+	Equivalent to calling toSDL(ColorLAB(l, a, b)) on every pixel.
+	*/
+	void rowFromLAB(const float* l, const float* a, const float* b, Uint32* pixels, int count)
+	{
+		switch (PIXEL_FORMAT->format)
+		{
+		case SDL_PIXELFORMAT_ARGB8888:	rowFromLABAs<FormatARGB8888>(l, a, b, pixels, count); break;
+		case SDL_PIXELFORMAT_RGB888:	rowFromLABAs<FormatRGB888>(l, a, b, pixels, count); break;
+		default:						rowFromLABAs<FormatSDL>(l, a, b, pixels, count); break;
+		}
+	}
+
+	template <class Format>
+	static void rowToLuminanceAs(const Uint32* pixels, float* luminance, int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			Uint8 r, g, b;
+			Format::unpack(pixels[i], r, g, b);
+			luminance[i] = ntscLuminance(r / 255.0f, g / 255.0f, b / 255.0f);
+		}
+	}
+
+	//NTSC luminance in [0, 1] of 'count' packed pixels, see ntscLuminance
+	void rowToLuminance(const Uint32* pixels, float* luminance, int count)
+	{
+		switch (PIXEL_FORMAT->format)
+		{
+		case SDL_PIXELFORMAT_ARGB8888:	rowToLuminanceAs<FormatARGB8888>(pixels, luminance, count); break;
+		case SDL_PIXELFORMAT_RGB888:	rowToLuminanceAs<FormatRGB888>(pixels, luminance, count); break;
+		default:						rowToLuminanceAs<FormatSDL>(pixels, luminance, count); break;
+		}
+	}
+
+	/*
+	The same from planar L, a and b: the pixels rowFromLAB would make, but without truncating them to 8 bits.
+	Scalar, since it's only run once per image a decomposition writes.
+	*/
+	void rowLuminanceFromLAB(const float* l, const float* a, const float* b, float* luminance, int count)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			float r, g, bl;
+			labToSRGB(l[i], a[i], b[i], r, g, bl);
+			luminance[i] = ntscLuminance(r / 255.0f, g / 255.0f, bl / 255.0f);
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <SDL.h>
+#include "Eisel.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EISEL_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+Fast versions of the color conversions in Eisel.cpp.
+
+The functions in Eisel.cpp are the reference implementation: double precision,
+one pixel at a time, calling pow for every channel.
+That's fine for clicking on a pixel, but far too slow for whole images.
+
+These work on whole rows at once and store L, a and b in separate float arrays (planar),
+which lets the compiler and SSE2 process 4 pixels per instruction.
+- sRGB -> linear uses a 256-entry lookup table (there are only 256 possible inputs).
+- Cube roots use a bit trick followed by Newton iterations instead of pow.
+- linear -> sRGB uses an interpolated lookup table instead of pow.
+
+Results agree with the reference to within one 8-bit level.
+*/
+
+namespace Eisel
+{
+	const int LINEAR_TO_SRGB_SIZE = 4096; //Number of intervals in the linear -> sRGB table
+
+	extern float SRGB_TO_LINEAR[256];						//8-bit sRGB value -> linear value in [0, 1]
+	extern float LINEAR_TO_SRGB[LINEAR_TO_SRGB_SIZE + 2];	//linear value in [0, 1] -> sRGB value in [0, 255]
+
+	float fastCbrt(float x);
+	float linearToSRGB(float linear); //Returns a value in [0, 255], still needs truncating
+
+	void rowToLAB(const Uint32* pixels, float* l, float* a, float* b, int count);
+	void rowFromLAB(const float* l, const float* a, const float* b, Uint32* pixels, int count);
+	void rowToLuminance(const Uint32* pixels, float* luminance, int count);
+	void rowLuminanceFromLAB(const float* l, const float* a, const float* b, float* luminance, int count);
+}
@@ -0,0 +1,167 @@
+#include "FastMath.h"
+
+namespace Eisel
+{
+	//Cody and Waite's range reduction and the polynomial from Cephes' expf
+	const float EXP_MIN = -87.3365448f;		//log(2^-126), the smallest normal float
+	const float EXP_MAX = 88.0f;			//Keeps the exponent below float's infinity
+	const float LOG2E = 1.44269504088896341f;
+	const float LN2_HIGH = 0.693359375f;	//ln(2) in two parts, so x - n * ln(2) doesn't lose precision
+	const float LN2_LOW = -2.12194440e-4f;
+	const float ROUNDER = 12582912.0f;		//1.5 * 2^23. Adding and subtracting it rounds to the nearest integer.
+
+	//fastExp for exactly LANES values
+	static void expBlock(const float* x, float* result)
+	{
+		int32_t exponents[LANES];
+		float mantissas[LANES];
+		for (int i = 0; i < LANES; i++)
+		{
+			//exp(x) = 2^n * exp(r), with n a whole number and r between -ln(2) / 2 and ln(2) / 2
+			float clamped = std::min(std::max(x[i], EXP_MIN), EXP_MAX);
+			float n = (clamped * LOG2E + ROUNDER) - ROUNDER;
+			float r = clamped - n * LN2_HIGH - n * LN2_LOW;
+
+			float p = 1.9875691500e-4f;
+			p = p * r + 1.3981999507e-3f;
+			p = p * r + 8.3334519073e-3f;
+			p = p * r + 4.1665795894e-2f;
+			p = p * r + 1.6666665459e-1f;
+			p = p * r + 5.0000001201e-1f;
+			p = p * r * r + r + 1.0f;
+
+			exponents[i] = ((int32_t)n + 127) << 23; //The bits of the float 2^n
+			mantissas[i] = x[i] < EXP_MIN ? 0.0f : p;
+		}
+
+		float powers[LANES];
+		memcpy(powers, exponents, sizeof(powers));
+		for (int i = 0; i < LANES; i++)
+		{
+			result[i] = mantissas[i] * powers[i];
+		}
+	}
+
+	void fastExp(const float* x, float* result, int count)
+	{
+		int full = count - count % LANES;
+		for (int i = 0; i < full; i += LANES)
+		{
+			expBlock(x + i, result + i);
+		}
+
+		//The last few go through a padded block
+		if (full < count)
+		{
+			float in[LANES] = {};
+			float out[LANES];
+			std::copy(x + full, x + count, in);
+			expBlock(in, out);
+			std::copy(out, out + count - full, result + full);
+		}
+	}
+
+	//Adds up the lanes at the end of a sum, in a fixed order
+	static float addLanes(const float* lanes)
+	{
+		float sum = 0.0f;
+		for (int i = 0; i < LANES; i++)
+		{
+			sum += lanes[i];
+		}
+		return sum;
+	}
+
+	void fastWeights(float* values, int count, float center)
+	{
+		int full = count - count % LANES;
+
+		//Average luminance, including the center pixel
+		float sums[LANES] = {};
+		for (int i = 0; i < full; i += LANES)
+		{
+			for (int j = 0; j < LANES; j++)
+			{
+				sums[j] += values[i + j];
+			}
+		}
+		float sum = center + addLanes(sums);
+		for (int i = full; i < count; i++)
+		{
+			sum += values[i];
+		}
+		float avg = sum / (count + 1);
+
+		//Variance, also including the center
+		float variances[LANES] = {};
+		for (int i = 0; i < full; i += LANES)
+		{
+			for (int j = 0; j < LANES; j++)
+			{
+				float deviation = values[i + j] - avg;
+				variances[j] += deviation * deviation;
+			}
+		}
+		float variance = (center - avg) * (center - avg) + addLanes(variances);
+		for (int i = full; i < count; i++)
+		{
+			variance += (values[i] - avg) * (values[i] - avg);
+		}
+
+		fastWeights(values, count, center, variance / (count + 1));
+	}
+
+	void fastWeights(float* values, int count, float center, float variance)
+	{
+		int full = count - count % LANES;
+
+		//The smallest squared difference from the center
+		float smallests[LANES];
+		std::fill(smallests, smallests + LANES, FLT_MAX);
+		for (int i = 0; i < full; i += LANES)
+		{
+			for (int j = 0; j < LANES; j++)
+			{
+				float fromCenter = center - values[i + j];
+				smallests[j] = std::min(smallests[j], fromCenter * fromCenter);
+			}
+		}
+		float smallest = *std::min_element(smallests, smallests + LANES);
+		for (int i = full; i < count; i++)
+		{
+			smallest = std::min(smallest, (center - values[i]) * (center - values[i]));
+		}
+
+		//Same limits as Canvas::referenceWeights. -1 / log(0.01) is 0.2171...
+		float csig = 0.6f * variance;
+		csig = std::max(csig, smallest * 0.217147241f);
+		csig = std::max(csig, 0.000002f);
+
+		float scale = -1.0f / csig;
+		for (int i = 0; i < count; i++)
+		{
+			values[i] = (center - values[i]) * (center - values[i]) * scale;
+		}
+		fastExp(values, values, count);
+
+		float sums[LANES] = {};
+		for (int i = 0; i < full; i += LANES)
+		{
+			for (int j = 0; j < LANES; j++)
+			{
+				sums[j] += values[i + j];
+			}
+		}
+		float sum = addLanes(sums);
+		for (int i = full; i < count; i++)
+		{
+			sum += values[i];
+		}
+
+		float inverse = 1.0f / sum;
+		for (int i = 0; i < count; i++)
+		{
+			values[i] *= inverse;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "Parallel.h"
+
+/*
+Vectorized versions of the maths that builds the interpolation matrix.
+
+The loops work on fixed blocks of LANES floats with LANES separate running sums,
+which is the shape compilers turn into SIMD: 8 floats is one AVX register, or two SSE ones.
+Plain loops that add up floats don't vectorize, because it would change the order of the additions.
+*/
+
+namespace Eisel
+{
+	const int LANES = 8;
+
+	/*
+	result[i] = exp(x[i]) for count values, with a polynomial instead of libm.
+	Anything under -87.3 (where exp stops being a normal float) gives 0. x and result may be the same array.
+	From -87 to 88 it's within 1e-7 of the exact exp, relatively: checking every float in that range gave 8.5e-8 at most.
+	*/
+	void fastExp(const float* x, float* result, int count);
+
+	/*
+	Turns the luminance of a pixel's neighbors into its interpolation weights, in place.
+	The same formula as Canvas::referenceWeights, with fastExp and the sums done LANES at a time.
+	The results differ from it by rounding, and by fastExp's error.
+	*/
+	void fastWeights(float* values, int count, float center);
+
+	//Same, with the variance of the neighborhood (center included) already known, see streamVariances
+	void fastWeights(float* values, int count, float center, float variance);
+}
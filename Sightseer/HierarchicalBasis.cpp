@@ -0,0 +1,527 @@
+#include "HierarchicalBasis.h"
+
+namespace Eisel
+{
+	/*
+	Calls body(x, y) for every node of a level that's eliminated on it (red), or every one that's kept (black).
+	Upright grids eliminate the nodes where x / step + y / step is odd.
+	Diagonal grids only have the nodes where that's even, and eliminate the ones in odd rows and columns.
+	Rows are split between threads.
+	*/
+	template<typename Body>
+	static void forEachNode(int width, int height, bool diagonal, int step, bool red, const Body& body)
+	{
+		int rows = (height - 1) / step + 1;
+		int rowNodes = (width - 1) / step / 2 + 1;
+		parallelFor(0, rows, [&](int firstRow, int lastRow)
+		{
+			for (int row = firstRow; row < lastRow; row++)
+			{
+				int first;
+				if (diagonal)
+				{
+					if ((row % 2 == 1) != red)
+						continue;
+					first = red ? step : 0;
+				}
+				else
+				{
+					first = (row % 2 == 1) == red ? 0 : step;
+				}
+
+				for (int x = first; x < width; x += 2 * step)
+				{
+					body(x, row * step);
+				}
+			}
+		}, std::max(1, 4096 / rowNodes));
+	}
+
+	HierarchicalBasis::HierarchicalBasis(int width, int height, const std::vector<float>& diagonal, const std::vector<float>& right, const std::vector<float>& down)
+		: width(width), height(height), res(width * height)
+	{
+		for (int direction = 0; direction < 4; direction++)
+		{
+			weights[direction].assign(res, 0.0f);
+		}
+		inverseDiagonal.assign(res, 1.0f);
+
+		for (int step = 1; step < std::max(width, height); step *= 2)
+		{
+			levels.push_back({ false, step });
+			levels.push_back({ true, step });
+		}
+
+		//The system as it is after every level so far has been eliminated
+		std::vector<float> currentDiagonal = diagonal;
+		std::vector<float> first = right;
+		std::vector<float> second = down;
+		std::vector<float> nextFirst(res), nextSecond(res);
+		for (const Level& level : levels)
+		{
+			std::fill(nextFirst.begin(), nextFirst.end(), 0.0f);
+			std::fill(nextSecond.begin(), nextSecond.end(), 0.0f);
+			eliminate(level, currentDiagonal, first, second, nextFirst, nextSecond);
+			first.swap(nextFirst);
+			second.swap(nextSecond);
+		}
+
+		//Pixel 0 is the only one never eliminated
+		if (currentDiagonal[0] > 0.0f)
+			inverseDiagonal[0] = 1.0f / currentDiagonal[0];
+	}
+
+	/*
+	Where the neighbor in 'direction' is on a level: left, right, up and down on an upright grid,
+	up-left, up-right, down-left and down-right on a diagonal one.
+	*/
+	void HierarchicalBasis::neighborOffset(const Level& level, int direction, int& offsetX, int& offsetY) const
+	{
+		if (level.diagonal)
+		{
+			offsetX = direction % 2 == 0 ? -level.step : level.step;
+			offsetY = direction < 2 ? -level.step : level.step;
+		}
+		else
+		{
+			offsetX = direction == 0 ? -level.step : direction == 1 ? level.step : 0;
+			offsetY = direction == 2 ? -level.step : direction == 3 ? level.step : 0;
+		}
+	}
+
+	/*
+	Eliminates a level's red nodes.
+	first and second hold each node's connections to 2 of its neighbors on this level, so every connection is stored once:
+	right and down on an upright grid, down-right and down-left on a diagonal one.
+	nextFirst and nextSecond get the same for the next level's grid.
+	The red nodes only touch black ones, so they're done one after another in any order.
+	*/
+	void HierarchicalBasis::eliminate(const Level& level, std::vector<float>& diagonal, std::vector<float>& first, std::vector<float>& second,
+		std::vector<float>& nextFirst, std::vector<float>& nextSecond)
+	{
+		int step = level.step;
+
+		//The 2 neighbors the next level stores connections to, as offsets
+		int nextFirstX = level.diagonal ? 2 * step : step;
+		int nextFirstY = level.diagonal ? 0 : step;
+		int nextSecondX = level.diagonal ? 0 : -step;
+		int nextSecondY = level.diagonal ? 2 * step : step;
+
+		//Red nodes are in every row of an upright grid, on alternate columns, and in every other row of a diagonal one
+		for (int y = level.diagonal ? step : 0; y < height; y += level.diagonal ? 2 * step : step)
+		{
+			int startX = level.diagonal || (y / step) % 2 == 0 ? step : 0;
+			for (int x = startX; x < width; x += 2 * step)
+			{
+				int node = y * width + x;
+
+				int neighbors[4];
+				int offsetsX[4], offsetsY[4];
+				double connections[4];
+				for (int direction = 0; direction < 4; direction++)
+				{
+					neighborOffset(level, direction, offsetsX[direction], offsetsY[direction]);
+					int neighborX = x + offsetsX[direction];
+					int neighborY = y + offsetsY[direction];
+					if (neighborX < 0 || neighborX >= width || neighborY < 0 || neighborY >= height)
+					{
+						neighbors[direction] = -1;
+						connections[direction] = 0.0;
+						continue;
+					}
+					neighbors[direction] = neighborY * width + neighborX;
+				}
+
+				//Each connection is stored on whichever of the 2 nodes it's first or second for
+				if (level.diagonal)
+				{
+					connections[0] = neighbors[0] >= 0 ? first[neighbors[0]] : 0.0;
+					connections[1] = neighbors[1] >= 0 ? second[neighbors[1]] : 0.0;
+					connections[2] = neighbors[2] >= 0 ? second[node] : 0.0;
+					connections[3] = neighbors[3] >= 0 ? first[node] : 0.0;
+				}
+				else
+				{
+					connections[0] = neighbors[0] >= 0 ? first[neighbors[0]] : 0.0;
+					connections[1] = neighbors[1] >= 0 ? first[node] : 0.0;
+					connections[2] = neighbors[2] >= 0 ? second[neighbors[2]] : 0.0;
+					connections[3] = neighbors[3] >= 0 ? second[node] : 0.0;
+				}
+
+				double pivot = diagonal[node];
+				if (!(pivot > 0.0))
+					continue; //Nothing to eliminate: it keeps a weight of 0 from everything and a diagonal of 1
+
+				inverseDiagonal[node] = (float)(1.0 / pivot);
+				for (int direction = 0; direction < 4; direction++)
+				{
+					if (neighbors[direction] < 0)
+						continue;
+
+					weights[direction][node] = (float)(connections[direction] / pivot);
+					diagonal[neighbors[direction]] -= (float)(connections[direction] * connections[direction] / pivot);
+				}
+
+				//What elimination adds between every pair of neighbors
+				for (int a = 0; a < 4; a++)
+				{
+					for (int b = a + 1; b < 4; b++)
+					{
+						if (neighbors[a] < 0 || neighbors[b] < 0)
+							continue;
+
+						double fill = connections[a] * connections[b] / pivot;
+						if (fill == 0.0)
+							continue;
+
+						//Store it on the neighbor that comes first, like the rest
+						int from = a;
+						int to = b;
+						int offsetX = offsetsX[b] - offsetsX[a];
+						int offsetY = offsetsY[b] - offsetsY[a];
+						if (offsetY < 0 || (offsetY == 0 && offsetX < 0))
+						{
+							std::swap(from, to);
+							offsetX = -offsetX;
+							offsetY = -offsetY;
+						}
+
+						if (offsetX == nextFirstX && offsetY == nextFirstY)
+						{
+							nextFirst[neighbors[from]] += (float)fill;
+						}
+						else if (offsetX == nextSecondX && offsetY == nextSecondY)
+						{
+							nextSecond[neighbors[from]] += (float)fill;
+						}
+						else
+						{
+							//Opposite neighbors aren't neighbors on the next grid. Dropping the connection without this would change both row sums.
+							diagonal[neighbors[from]] -= (float)fill;
+							diagonal[neighbors[to]] -= (float)fill;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	//Rows of a sparse matrix, in blocks that are each filled by one thread
+	struct RowBlock
+	{
+		std::vector<int> start; //Where each row's non-zeros start, plus one past the end
+		std::vector<int> columns;
+		std::vector<float> values;
+	};
+
+	/*
+	Going from one level to the next, A becomes P^T * A * P on the black nodes,
+	where P keeps black nodes as they are and interpolates red ones from their black neighbors.
+	The red nodes' basis functions don't change after their own level, so their diagonal is done by then.
+	Only A's first version comes from 'rows'. The coarser ones are stored in RowBlocks, numbered by where the nodes are in 'nodes'.
+	*/
+	void HierarchicalBasis::matchDiagonal(const RowAccess& rows)
+	{
+		std::vector<int> eliminatedOn(res, (int)levels.size());
+		for (int l = 0; l < levels.size(); l++)
+		{
+			forEachNode(width, height, levels[l].diagonal, levels[l].step, true, [&](int x, int y)
+			{
+				eliminatedOn[y * width + x] = l;
+			});
+		}
+
+		//The nodes left on the current level, and where every pixel is among them. Everything's there for the first one.
+		std::vector<int> nodes(res);
+		std::vector<int> index(res);
+		for (int i = 0; i < res; i++)
+		{
+			nodes[i] = i;
+			index[i] = i;
+		}
+		std::vector<RowBlock> system; //Empty until it's been coarsened once
+		int blockRows = 1;
+
+		/*
+		Points 'columns' and 'values' at a row of the current A and returns how long it is.
+		Pixels and nodes are the same until it's coarsened, and until then the row is copied to the vectors.
+		*/
+		auto fetch = [&](int node, std::vector<int>& columnBuffer, std::vector<float>& valueBuffer, const int*& columns, const float*& values)
+		{
+			if (system.empty())
+			{
+				columnBuffer.clear();
+				valueBuffer.clear();
+				rows(node, columnBuffer, valueBuffer);
+				columns = columnBuffer.data();
+				values = valueBuffer.data();
+				return (int)columnBuffer.size();
+			}
+
+			const RowBlock& block = system[node / blockRows];
+			int row = node % blockRows;
+			columns = block.columns.data() + block.start[row];
+			values = block.values.data() + block.start[row];
+			return block.start[row + 1] - block.start[row];
+		};
+
+		//Takes a node's diagonal from the current A. The ones that come out at 0 or below keep the elimination's.
+		auto finish = [&](int first, int last, const std::vector<int>& nextIndex)
+		{
+			std::vector<int> columnBuffer;
+			std::vector<float> valueBuffer;
+			for (int node = first; node < last; node++)
+			{
+				if (!nextIndex.empty() && nextIndex[node] >= 0)
+					continue;
+
+				const int* columns;
+				const float* values;
+				int length = fetch(node, columnBuffer, valueBuffer, columns, values);
+				for (int entry = 0; entry < length; entry++)
+				{
+					if (columns[entry] == node && values[entry] > 0.0f)
+						inverseDiagonal[nodes[node]] = 1.0f / values[entry];
+				}
+			}
+		};
+
+		for (int l = 0; l < levels.size(); l++)
+		{
+			const Level& level = levels[l];
+			int count = (int)nodes.size();
+
+			//Where each node is on the next level, -1 for red ones
+			std::vector<int> nextIndex(count, -1);
+			std::vector<int> nextNodes;
+			for (int node = 0; node < count; node++)
+			{
+				if (eliminatedOn[nodes[node]] > l)
+				{
+					nextIndex[node] = (int)nextNodes.size();
+					nextNodes.push_back(nodes[node]);
+				}
+			}
+
+			parallelFor(0, count, [&](int first, int last) { finish(first, last, nextIndex); }, 256);
+
+			int offsetsX[4], offsetsY[4];
+			for (int direction = 0; direction < 4; direction++)
+			{
+				neighborOffset(level, direction, offsetsX[direction], offsetsY[direction]);
+			}
+
+			/*
+			The rows of P: up to 4 nodes on the next level, and their weights.
+			Black nodes get themselves with a weight of 1 and 3 weights of 0, so every node is handled the same way.
+			*/
+			std::vector<int> interpolatedFrom((size_t)count * 4, 0);
+			std::vector<float> interpolationWeights((size_t)count * 4, 0.0f);
+			parallelFor(0, count, [&](int first, int last)
+			{
+				for (int node = first; node < last; node++)
+				{
+					if (nextIndex[node] >= 0)
+					{
+						interpolatedFrom[(size_t)node * 4] = nextIndex[node];
+						interpolationWeights[(size_t)node * 4] = 1.0f;
+						continue;
+					}
+
+					int red = nodes[node];
+					int x = red % width;
+					int y = red / width;
+					for (int direction = 0; direction < 4; direction++)
+					{
+						int neighborX = x + offsetsX[direction];
+						int neighborY = y + offsetsY[direction];
+						if (neighborX >= 0 && neighborX < width && neighborY >= 0 && neighborY < height)
+						{
+							interpolatedFrom[(size_t)node * 4 + direction] = nextIndex[index[neighborY * width + neighborX]];
+							interpolationWeights[(size_t)node * 4 + direction] = weights[direction][red];
+						}
+					}
+				}
+			}, 1024);
+
+			int nextCount = (int)nextNodes.size();
+			int blocks = std::max(1, std::min(threadCount(), nextCount / 256));
+			int nextBlockRows = (nextCount + blocks - 1) / blocks;
+			std::vector<RowBlock> next(blocks);
+			parallelTasks(blocks, [&](int b)
+			{
+				RowBlock& block = next[b];
+				std::vector<double> sums(nextCount, 0.0);
+				std::vector<int> touched;
+				std::vector<int> columnBuffer;
+				std::vector<float> valueBuffer;
+
+				int first = b * nextBlockRows;
+				int last = std::min(nextCount, first + nextBlockRows);
+				block.start.push_back(0);
+				for (int row = first; row < last; row++)
+				{
+					int x = nextNodes[row] % width;
+					int y = nextNodes[row] / width;
+
+					//The rows of P^T: the black node itself, and the red nodes interpolated from it
+					int from[5] = { index[nextNodes[row]] };
+					double fromWeights[5] = { 1.0 };
+					int fromCount = 1;
+					for (int direction = 0; direction < 4; direction++)
+					{
+						int redX = x - offsetsX[direction];
+						int redY = y - offsetsY[direction];
+						if (redX < 0 || redX >= width || redY < 0 || redY >= height)
+							continue;
+
+						int red = redY * width + redX;
+						if (weights[direction][red] != 0.0f)
+						{
+							from[fromCount] = index[red];
+							fromWeights[fromCount++] = weights[direction][red];
+						}
+					}
+
+					//Times A, times P
+					for (int f = 0; f < fromCount; f++)
+					{
+						const int* columns;
+						const float* values;
+						int length = fetch(from[f], columnBuffer, valueBuffer, columns, values);
+						for (int entry = 0; entry < length; entry++)
+						{
+							double value = fromWeights[f] * values[entry];
+							const int* to = interpolatedFrom.data() + (size_t)columns[entry] * 4;
+							const float* toWeights = interpolationWeights.data() + (size_t)columns[entry] * 4;
+							for (int direction = 0; direction < 4; direction++)
+							{
+								//No branches, so columns come up over and over and ones with 0 weights get added too. Writing the row out sorts that.
+								sums[to[direction]] += value * toWeights[direction];
+								touched.push_back(to[direction]);
+							}
+						}
+					}
+
+					//Each column once, leaving sums all 0 for the next row
+					for (int column : touched)
+					{
+						if (sums[column] != 0.0)
+						{
+							block.columns.push_back(column);
+							block.values.push_back((float)sums[column]);
+							sums[column] = 0.0;
+						}
+					}
+					touched.clear();
+					block.start.push_back((int)block.columns.size());
+				}
+			});
+
+			for (int node = 0; node < nextCount; node++)
+			{
+				index[nextNodes[node]] = node;
+			}
+			nodes.swap(nextNodes);
+			system.swap(next);
+			blockRows = nextBlockRows;
+		}
+
+		//Pixel 0's, which is never eliminated
+		finish(0, (int)nodes.size(), std::vector<int>());
+	}
+
+	void HierarchicalBasis::apply(const float* r, float* z) const
+	{
+		std::copy(r, r + res, z);
+
+		//z = S^T * z, finest level first. Each black node gathers from the red nodes around it.
+		for (const Level& level : levels)
+		{
+			int offsetsX[4], offsetsY[4], offsets[4];
+			for (int direction = 0; direction < 4; direction++)
+			{
+				neighborOffset(level, direction, offsetsX[direction], offsetsY[direction]);
+				offsets[direction] = offsetsY[direction] * width + offsetsX[direction];
+			}
+
+			int step = level.step;
+			forEachNode(width, height, level.diagonal, step, false, [&](int x, int y)
+			{
+				int node = y * width + x;
+
+				//Neighbors are at most a step away along each axis, so away from the borders they're all there
+				if (x >= step && x < width - step && y >= step && y < height - step)
+				{
+					z[node] += weights[0][node - offsets[0]] * z[node - offsets[0]] + weights[1][node - offsets[1]] * z[node - offsets[1]]
+						+ weights[2][node - offsets[2]] * z[node - offsets[2]] + weights[3][node - offsets[3]] * z[node - offsets[3]];
+					return;
+				}
+
+				float sum = 0.0f;
+				for (int direction = 0; direction < 4; direction++)
+				{
+					int redX = x - offsetsX[direction]; //The red node that has this one as its neighbor in 'direction'
+					int redY = y - offsetsY[direction];
+					if (redX >= 0 && redX < width && redY >= 0 && redY < height)
+					{
+						int red = redY * width + redX;
+						sum += weights[direction][red] * z[red];
+					}
+				}
+				z[node] += sum;
+			});
+		}
+
+		parallelFor(0, res, [&](int first, int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				z[i] *= inverseDiagonal[i];
+			}
+		}, 4096);
+
+		//z = S * z, coarsest level first. Each red node is interpolated from its black neighbors.
+		for (int l = (int)levels.size() - 1; l >= 0; l--)
+		{
+			const Level& level = levels[l];
+			int offsetsX[4], offsetsY[4], offsets[4];
+			for (int direction = 0; direction < 4; direction++)
+			{
+				neighborOffset(level, direction, offsetsX[direction], offsetsY[direction]);
+				offsets[direction] = offsetsY[direction] * width + offsetsX[direction];
+			}
+
+			int step = level.step;
+			forEachNode(width, height, level.diagonal, step, true, [&](int x, int y)
+			{
+				int node = y * width + x;
+				if (x >= step && x < width - step && y >= step && y < height - step)
+				{
+					z[node] += weights[0][node] * z[node + offsets[0]] + weights[1][node] * z[node + offsets[1]]
+						+ weights[2][node] * z[node + offsets[2]] + weights[3][node] * z[node + offsets[3]];
+					return;
+				}
+
+				float sum = 0.0f;
+				for (int direction = 0; direction < 4; direction++)
+				{
+					int neighborX = x + offsetsX[direction];
+					int neighborY = y + offsetsY[direction];
+					if (neighborX >= 0 && neighborX < width && neighborY >= 0 && neighborY < height)
+					{
+						sum += weights[direction][node] * z[neighborY * width + neighborX];
+					}
+				}
+				z[node] += sum;
+			});
+		}
+	}
+
+	Eigen::VectorXf HierarchicalBasis::solve(const Eigen::VectorXf& r) const
+	{
+		Eigen::VectorXf z(res);
+		apply(r.data(), z.data());
+		return z;
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <Eigen/Core>
+#include "Parallel.h"
+
+/*
+Szeliski's locally adapted hierarchical basis preconditioner, from "Locally Adapted Hierarchical Basis Preconditioning" (SIGGRAPH 2006).
+
+BiCGSTAB fixes the error a little at a time through the matrix's neighborhoods,
+so errors that are smooth over big areas of the image take most of the iterations, and more the bigger the image is.
+A hierarchical basis describes the solution at every scale at once, which makes those errors cheap.
+"Locally adapted" means the basis is built from the system itself, so it follows edges the same way the weights do.
+
+It works on a 4-neighbor grid system, coarsened over and over by Gaussian elimination:
+half the nodes (every other one, like a checkerboard) are eliminated, which leaves the rest on a grid turned 45 degrees,
+then half of those, which leaves an upright grid twice as coarse, and so on down to a single node.
+Each eliminated node is interpolated from its 4 neighbors with weights that come from the elimination.
+Elimination also connects the neighbors to each other. The new connections along the coarser grid are kept,
+and the ones between opposite neighbors are dropped and added to the diagonal instead, which keeps the row sums the same.
+
+Applying the preconditioner is then S * D^-1 * S^T, with S the interpolation from all levels:
+a pass down the levels, a scaling and a pass back up.
+D approximates S^T * A * S by its diagonal. The elimination gives one for the 4-neighbor system,
+but when it stands in for a system with wider neighborhoods, that's only close for the coarse levels.
+matchDiagonal works out the real one from A.
+Each pixel is eliminated on exactly one level, so its weights and diagonal are stored as one plane each for all levels.
+*/
+
+namespace Eisel
+{
+	class HierarchicalBasis
+	{
+	public:
+		/*
+		Builds the basis for the 4-neighbor system with diagonal[i] on the diagonal,
+		-right[i] between pixel i and the one to its right, and -down[i] between pixel i and the one below.
+		The system should be symmetric with diagonals at least as big as the row's other entries, like a graph Laplacian.
+		*/
+		HierarchicalBasis(int width, int height, const std::vector<float>& diagonal, const std::vector<float>& right, const std::vector<float>& down);
+
+		//Appends the column and value of every non-zero of a row of A
+		typedef std::function<void(int row, std::vector<int>& columns, std::vector<float>& values)> RowAccess;
+
+		/*
+		Replaces D with the diagonal of S^T * A * S, for the matrix A the basis preconditions.
+		It's worked out a level at a time: a node's diagonal is the one of A coarsened by every level before its own.
+		The coarsened matrices have about as many non-zeros per row as A, on half as many rows each level,
+		so this takes around as much memory as A while it runs. It's slow though: 100 to 200 products with A.
+		*/
+		void matchDiagonal(const RowAccess& rows);
+
+		//z = M^-1 * r. Both are width * height long.
+		void apply(const float* r, float* z) const;
+
+		//The same, for Eisel::bicgstab
+		Eigen::VectorXf solve(const Eigen::VectorXf& r) const;
+
+		int width;
+		int height;
+		int res; //Resolution = total number of pixels
+
+	private:
+		//Levels alternate between upright grids (neighbors step pixels away along x and y) and diagonal grids (step pixels away along both)
+		struct Level
+		{
+			bool diagonal;
+			int step;
+		};
+
+		void eliminate(const Level& level, std::vector<float>& diagonal, std::vector<float>& first, std::vector<float>& second,
+			std::vector<float>& nextFirst, std::vector<float>& nextSecond);
+		void neighborOffset(const Level& level, int direction, int& offsetX, int& offsetY) const;
+
+		std::vector<Level> levels;				//Finest first
+		std::vector<float> weights[4];			//Interpolation weights of each pixel from its neighbors on the level it's eliminated on
+		std::vector<float> inverseDiagonal;
+	};
+}
@@ -0,0 +1,142 @@
+#include "LabImage.h"
+
+LabImage::LabImage(int width, int height, bool hasAlpha)
+{
+	this->width = width;
+	this->height = height;
+	res = width * height;
+
+	l = a = b = luminance = alpha = nullptr;
+	try
+	{
+		l = new float[res]();
+		a = new float[res]();
+		b = new float[res]();
+		luminance = new float[res]();
+		if (hasAlpha)
+		{
+			alpha = new float[res];
+			std::fill(alpha, alpha + res, 1.0f);
+		}
+	}
+	catch (...)
+	{
+		//The destructor doesn't run if the constructor throws, so the planes that did get allocated are freed here
+		delete[] l;
+		delete[] a;
+		delete[] b;
+		delete[] luminance;
+		throw;
+	}
+}
+
+LabImage::LabImage(Uint32* pixels, int width, int height, bool hasAlpha) : LabImage(width, height, hasAlpha)
+{
+	fromPixels(pixels);
+}
+
+LabImage::~LabImage()
+{
+	delete[] l;
+	delete[] a;
+	delete[] b;
+	delete[] luminance;
+	delete[] alpha;
+}
+
+void LabImage::copyFrom(LabImage* other)
+{
+	//Both images must be the same size. Alpha is only copied if both have it.
+	std::copy(other->l, other->l + res, l);
+	std::copy(other->a, other->a + res, a);
+	std::copy(other->b, other->b + res, b);
+	std::copy(other->luminance, other->luminance + res, luminance);
+	if (alpha != nullptr && other->alpha != nullptr)
+	{
+		std::copy(other->alpha, other->alpha + res, alpha);
+	}
+}
+
+/*
+Copies a width * height rectangle of 'source', starting at (sourceX, sourceY),
+into this image starting at (destX, destY). Used to crop and paste back regions of interest.
+The rectangle must fit inside both images. Alpha is only copied if both have it.
+*/
+void LabImage::copyRegion(LabImage* source, int sourceX, int sourceY, int destX, int destY, int width, int height)
+{
+	for (int y = 0; y < height; y++)
+	{
+		int from = source->XYtoIndex(sourceX, sourceY + y);
+		int to = XYtoIndex(destX, destY + y);
+		std::copy(source->l + from, source->l + from + width, l + to);
+		std::copy(source->a + from, source->a + from + width, a + to);
+		std::copy(source->b + from, source->b + from + width, b + to);
+		std::copy(source->luminance + from, source->luminance + from + width, luminance + to);
+		if (alpha != nullptr && source->alpha != nullptr)
+		{
+			std::copy(source->alpha + from, source->alpha + from + width, alpha + to);
+		}
+	}
+}
+
+void LabImage::fromPixels(Uint32* pixels)
+{
+	parallelFor(0, height, [&](int firstRow, int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			int row = XYtoIndex(0, y);
+			rowToLAB(pixels + row, l + row, a + row, b + row, width);
+			rowToLuminance(pixels + row, luminance + row, width);
+		}
+	});
+
+	if (alpha != nullptr && PIXEL_FORMAT->Amask != 0)
+	{
+		for (int i = 0; i < res; i++)
+		{
+			alpha[i] = ((pixels[i] & PIXEL_FORMAT->Amask) >> PIXEL_FORMAT->Ashift) / 255.0f;
+		}
+	}
+}
+
+void LabImage::toPixels(Uint32* pixels)
+{
+	parallelFor(0, height, [&](int firstRow, int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			int row = XYtoIndex(0, y);
+			rowFromLAB(l + row, a + row, b + row, pixels + row, width);
+		}
+	});
+
+	//rowFromLAB makes every pixel opaque, so only non-opaque alpha needs writing
+	if (alpha != nullptr && PIXEL_FORMAT->Amask != 0)
+	{
+		for (int i = 0; i < res; i++)
+		{
+			Uint32 value = (Uint32)(clamp(alpha[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+			pixels[i] = (pixels[i] & ~PIXEL_FORMAT->Amask) | ((value << PIXEL_FORMAT->Ashift) & PIXEL_FORMAT->Amask);
+		}
+	}
+}
+
+//Recomputes the luminance plane from L, a and b, after they've been changed
+void LabImage::updateLuminance()
+{
+	parallelFor(0, height, [&](int firstRow, int lastRow)
+	{
+		for (int y = firstRow; y < lastRow; y++)
+		{
+			int row = XYtoIndex(0, y);
+			rowLuminanceFromLAB(l + row, a + row, b + row, luminance + row, width);
+		}
+	});
+}
+
+int LabImage::XYtoIndex(int x, int y)
+{
+	//Take an (x, y) coordinate pair and return the corresponding index in a 1-dimensional array
+	return y * width + x;
+}
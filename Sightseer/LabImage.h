@@ -0,0 +1,51 @@
+#pragma once
+
+#include <SDL.h>
+#include "Eisel.h"
+#include "FastColor.h"
+#include "Parallel.h"
+
+using namespace Eisel;
+
+/*
+An image stored as separate float planes of L, a and b (and optionally alpha).
+
+This is the working format for everything in Canvas.
+Images are converted into it once when they're loaded,
+and only converted back to SDL's packed pixels when they need to be displayed.
+That way nothing gets rounded to 8 bits between steps.
+
+L is in [0, 100], a and b are in [-128, 128], alpha is in [0, 1].
+
+Every image also keeps the NTSC luminance (the Y of rgb2ntsc) of its pixels, in [0, 1].
+That's what decompositions find extrema and weights on, like the MatLab code, not L.
+Images loaded from pixels get it from their 8-bit RGB, exactly as before they were stored as LAB.
+Anything that writes L, a or b directly has to call updateLuminance afterwards.
+*/
+class LabImage
+{
+public:
+	LabImage(int width, int height, bool hasAlpha = false);
+	LabImage(Uint32* pixels, int width, int height, bool hasAlpha = false);
+	~LabImage();
+
+	void copyFrom(LabImage* other);
+	void copyRegion(LabImage* source, int sourceX, int sourceY, int destX, int destY, int width, int height);
+	void fromPixels(Uint32* pixels);
+	void toPixels(Uint32* pixels);
+	void updateLuminance();
+
+	int XYtoIndex(int x, int y);
+
+	float* l;
+	float* a;
+	float* b;
+	float* alpha; //nullptr unless the image was created with an alpha plane
+	float* luminance; //NTSC Y, see above
+
+	static const int PIXEL_BYTES = 4 * sizeof(float); //l, a, b and luminance, without alpha
+
+	int width;
+	int height;
+	int res; //Resolution = total number of pixels
+};
@@ -0,0 +1,106 @@
+#include "Ordering.h"
+
+namespace Eisel
+{
+	//Spreads the low 16 bits of 'value' out to the even bits
+	static Uint32 spreadBits(Uint32 value)
+	{
+		value &= 0xFFFF;
+		value = (value | (value << 8)) & 0x00FF00FF;
+		value = (value | (value << 4)) & 0x0F0F0F0F;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	}
+
+	void mortonOrder(int width, int height, std::vector<int>& newIndex)
+	{
+		int res = width * height;
+		std::vector<std::pair<Uint32, int>> codes(res);
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int i = y * width + x;
+				codes[i] = std::make_pair(spreadBits(x) | (spreadBits(y) << 1), i);
+			}
+		}
+		std::sort(codes.begin(), codes.end());
+
+		newIndex.resize(res);
+		for (int position = 0; position < res; position++)
+		{
+			newIndex[codes[position].second] = position;
+		}
+	}
+
+	void reverseCuthillMcKee(const SparseColumns& A, std::vector<int>& newIndex)
+	{
+		/*
+		The rows of extrema only have their diagonal, so A on its own isn't symmetric
+		and the search would never find the extrema from their neighbors.
+		That's why the transpose's non-zeros count too.
+		*/
+		const SparseColumns transposed = A.transpose();
+
+		int n = A.cols();
+		std::vector<int> degree(n);
+		for (int j = 0; j < n; j++)
+		{
+			degree[j] = (int)(A.outerIndexPtr()[j + 1] - A.outerIndexPtr()[j] + transposed.outerIndexPtr()[j + 1] - transposed.outerIndexPtr()[j]);
+		}
+
+		//Searches start from the lowest degree pixel that hasn't been visited yet (usually a corner)
+		std::vector<int> byDegree(n);
+		for (int j = 0; j < n; j++)
+		{
+			byDegree[j] = j;
+		}
+		std::stable_sort(byDegree.begin(), byDegree.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+
+		std::vector<int> order;
+		order.reserve(n);
+		std::vector<bool> visited(n, false);
+		std::vector<int> neighbors;
+		int nextStart = 0;
+
+		while ((int)order.size() < n)
+		{
+			//A new connected component
+			while (visited[byDegree[nextStart]])
+			{
+				nextStart++;
+			}
+			int start = byDegree[nextStart];
+			visited[start] = true;
+			int head = order.size(); //order doubles as the search queue
+			order.push_back(start);
+
+			while (head < (int)order.size())
+			{
+				int j = order[head++];
+				neighbors.clear();
+				for (auto matrix : { &A, &transposed })
+				{
+					for (SparseColumns::InnerIterator it(*matrix, j); it; ++it)
+					{
+						int i = it.index();
+						if (!visited[i])
+						{
+							visited[i] = true;
+							neighbors.push_back(i);
+						}
+					}
+				}
+				std::stable_sort(neighbors.begin(), neighbors.end(), [&](int a, int b) { return degree[a] < degree[b]; });
+				order.insert(order.end(), neighbors.begin(), neighbors.end());
+			}
+		}
+
+		newIndex.resize(n);
+		for (int position = 0; position < n; position++)
+		{
+			newIndex[order[position]] = n - 1 - position; //Reversed
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <SDL.h>
+#include <Eigen/Sparse>
+#include "Solver.h"
+
+/*
+Orderings of the unknowns (one per pixel) for the interpolation solve.
+
+Pixels are numbered row by row, so the k * k neighbors of a pixel are spread over k image rows:
+every row of the matrix reads the solution vector in k places that are a whole image row apart.
+On a big image that's megabytes apart and most of those reads miss the cache.
+Renumbering the pixels so that neighbors get nearby numbers keeps those reads close together.
+
+Each function fills newIndex[oldIndex] with the pixel's position in the new order.
+*/
+
+namespace Eisel
+{
+	/*
+	Z-order (Morton) curve: pixels are sorted by their x and y bits interleaved,
+	so the image is walked in 2x2 blocks, then 4x4 blocks of those, and so on.
+	Only depends on the image size.
+	*/
+	void mortonOrder(int width, int height, std::vector<int>& newIndex);
+
+	/*
+	Reverse Cuthill-McKee over the graph of A: a breadth first search from a low degree pixel,
+	visiting neighbors with the fewest connections first, then reversed.
+	That keeps the non-zeros in a narrow band around the diagonal.
+	Pixels i and j are neighbors if A(i, j) or A(j, i) isn't 0.
+	*/
+	void reverseCuthillMcKee(const SparseColumns& A, std::vector<int>& newIndex);
+}
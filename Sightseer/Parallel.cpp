@@ -0,0 +1,200 @@
+#include "Parallel.h"
+
+namespace Eisel
+{
+	/*
+	The threads parallelFor runs on. They're started the first time they're needed and then sleep between jobs,
+	because starting threads for every call costs more than a small loop does,
+	and the solver calls parallelFor several times per iteration.
+
+	One job runs at a time. It's split into numbered blocks, and the pool's threads
+	and the thread that started the job all take blocks until there are none left.
+	If a block throws, on any thread, the blocks nobody has started yet are skipped,
+	and run rethrows the exception once the threads are done with the ones they had.
+	*/
+	class ThreadPool
+	{
+	public:
+		ThreadPool(int threads);
+		~ThreadPool();
+
+		void run(int blocks, const std::function<void(int)>& task);
+
+	private:
+		void workerLoop();
+		void work();
+
+		std::vector<std::thread> workers;
+		std::mutex submitMutex;			//Held for the whole job, so jobs from different threads take turns
+		std::mutex mutex;				//Protects everything below apart from the atomics
+		std::condition_variable wake;	//Workers wait on this for a job
+		std::condition_variable done;	//run waits on this for the job to finish
+
+		const std::function<void(int)>* task = nullptr;
+		int blockCount = 0;
+		std::atomic<int> nextBlock;
+		std::atomic<int> pendingBlocks;
+		std::atomic<bool> failed;		//A block of the current job threw
+		std::exception_ptr error;		//The first exception a block threw
+		int activeWorkers = 0;			//Workers that joined the current job and haven't left it yet
+		unsigned generation = 0;		//Goes up with every job, so workers can tell a new job from one they already did
+		bool stopping = false;
+	};
+
+	//Set on pool threads, and on any thread while it runs blocks. parallelFor calls made from inside a block run serially.
+	static thread_local bool insideJob = false;
+
+	ThreadPool::ThreadPool(int threads)
+	{
+		nextBlock = 0;
+		pendingBlocks = 0;
+		failed = false;
+		for (int i = 0; i < threads; i++)
+		{
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	//Calls task(0) to task(blocks - 1), spread over the pool and the calling thread. Returns once they're all done.
+	void ThreadPool::run(int blocks, const std::function<void(int)>& task)
+	{
+		std::lock_guard<std::mutex> submit(submitMutex);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->task = &task;
+			blockCount = blocks;
+			nextBlock = 0;
+			pendingBlocks = blocks;
+			failed = false;
+			error = nullptr;
+			generation++;
+		}
+		wake.notify_all();
+
+		insideJob = true;
+		work();
+		insideJob = false;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return pendingBlocks == 0 && activeWorkers == 0; });
+		this->task = nullptr; //Workers that wake up late won't join a job that's over
+		if (error)
+		{
+			std::exception_ptr thrown = error;
+			error = nullptr;
+			std::rethrow_exception(thrown);
+		}
+	}
+
+	void ThreadPool::workerLoop()
+	{
+		insideJob = true;
+		unsigned lastGeneration = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [&]() { return stopping || (task != nullptr && generation != lastGeneration); });
+			if (stopping)
+				return;
+
+			lastGeneration = generation;
+			activeWorkers++;
+			lock.unlock();
+			work();
+			lock.lock();
+			activeWorkers--;
+			if (activeWorkers == 0 && pendingBlocks == 0)
+				done.notify_all();
+		}
+	}
+
+	void ThreadPool::work()
+	{
+		while (true)
+		{
+			int block = nextBlock++;
+			if (block >= blockCount)
+				return;
+			if (!failed)
+			{
+				try
+				{
+					(*task)(block);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error)
+						error = std::current_exception();
+					failed = true;
+				}
+			}
+			if (--pendingBlocks == 0)
+			{
+				std::lock_guard<std::mutex> lock(mutex); //So run can't miss the notification between checking and waiting
+				done.notify_all();
+			}
+		}
+	}
+
+	int threadCount()
+	{
+		//hardware_concurrency is allowed to return 0 if it can't tell
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	static ThreadPool& threadPool()
+	{
+		static ThreadPool pool(threadCount() - 1); //The calling thread makes up the last one
+		return pool;
+	}
+
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& body, int minBlock)
+	{
+		int count = end - begin;
+		if (count <= 0)
+			return;
+
+		int blocks = std::min(threadCount(), (count + minBlock - 1) / minBlock);
+		if (blocks <= 1 || insideJob)
+		{
+			body(begin, end);
+			return;
+		}
+
+		threadPool().run(blocks, [&](int block)
+		{
+			body(begin + (int)((long long)count * block / blocks), begin + (int)((long long)count * (block + 1) / blocks));
+		});
+	}
+
+	void parallelTasks(int count, const std::function<void(int)>& task)
+	{
+		if (count <= 0)
+			return;
+
+		if (count == 1 || threadCount() == 1 || insideJob)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				task(i);
+			}
+			return;
+		}
+
+		threadPool().run(count, task); //The pool already hands blocks out one at a time
+	}
+}
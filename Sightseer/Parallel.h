@@ -0,0 +1,34 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Eisel
+{
+	int threadCount();
+
+	/*
+	Splits [begin, end) into one contiguous block per hardware thread
+	and calls body(blockBegin, blockEnd) for each block in parallel.
+	Blocks are never smaller than minBlock, so small ranges run on the calling thread.
+	Returns once every block is done.
+	The blocks run on a pool of threads that's kept around between calls, so calling this often is cheap.
+	Calls from several threads take turns, and calls from inside a body run serially.
+	If a body throws, the blocks that haven't started are skipped and the exception is rethrown here once the rest are done.
+	*/
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& body, int minBlock = 1);
+
+	/*
+	Calls task(0) to task(count - 1) in parallel, on the same threads as parallelFor.
+	Threads take the next task as soon as they're done with one, so tasks of very different sizes still balance,
+	as long as the biggest ones come first.
+	Returns once every task is done.
+	*/
+	void parallelTasks(int count, const std::function<void(int)>& task);
+}
@@ -0,0 +1,238 @@
+#include "Scanline.h"
+
+namespace Eisel
+{
+	RowWindow::RowWindow(int width, int height, int reach, const RowSource& source)
+		: width(width), height(height), reach(reach), span(2 * reach + 1), loaded(0), source(source)
+	{
+		rows.resize((size_t)std::min(span, height) * width);
+	}
+
+	void RowWindow::moveTo(int y)
+	{
+		int last = std::min(height - 1, y + reach);
+		for (; loaded <= last; loaded++)
+		{
+			source(loaded, rows.data() + (size_t)(loaded % span) * width);
+		}
+	}
+
+	void streamExtrema(int width, int height, const std::vector<int>& offsets, int rank, const RowSource& source,
+		const FlagSink& minimaSink, const FlagSink& maximaSink)
+	{
+		RowWindow window(width, height, offsets.back(), source);
+		std::vector<int> minima(width);
+		std::vector<int> maxima(width);
+		std::vector<const float*> neighborRows;
+
+		for (int y = 0; y < height; y++)
+		{
+			window.moveTo(y);
+			neighborRows.clear();
+			for (int offsetY : offsets)
+			{
+				if (y + offsetY >= 0 && y + offsetY < height)
+					neighborRows.push_back(window.row(y + offsetY));
+			}
+
+			const float* center = window.row(y);
+			for (int x = 0; x < width; x++)
+			{
+				float centerLum = center[x];
+				int numSmaller = 0;
+				int numLarger = 0;
+				for (const float* row : neighborRows)
+				{
+					for (int offsetX : offsets)
+					{
+						if (x + offsetX >= 0 && x + offsetX < width)
+						{
+							numSmaller += row[x + offsetX] < centerLum;
+							numLarger += row[x + offsetX] > centerLum;
+						}
+					}
+				}
+				minima[x] = numSmaller <= rank;
+				maxima[x] = numLarger <= rank;
+			}
+
+			if (minimaSink)
+				minimaSink(y, minima.data());
+			if (maximaSink)
+				maximaSink(y, maxima.data());
+		}
+	}
+
+	void streamVariances(int width, int height, const std::vector<int>& offsets, const RowSource& source, const VarianceSink& sink)
+	{
+		int radius = offsets.back();
+		int spacing = offsets.size() > 1 ? offsets[1] - offsets[0] : 1;
+		bool even = true;
+		for (size_t i = 1; i < offsets.size(); i++)
+		{
+			if (offsets[i] - offsets[i - 1] != spacing)
+				even = false;
+		}
+
+		//A row comes out of its phase's column sums 'spacing' rows after it's last in reach, so the window keeps that many more
+		RowWindow window(width, height, even ? radius + spacing : radius, source);
+		window.moveTo(0);
+
+		//Taking the first row's average off keeps the sums small, since they're only ever added to and taken from
+		const float* firstRow = window.row(0);
+		double offset = 0.0;
+		for (int x = 0; x < width; x++)
+		{
+			offset += firstRow[x];
+		}
+		offset /= width;
+
+		auto addRow = [&](int y, double sign, double* sums, double* squares)
+		{
+			const float* row = window.row(y);
+			for (int x = 0; x < width; x++)
+			{
+				double value = row[x] - offset;
+				sums[x] += sign * value;
+				squares[x] += sign * value * value;
+			}
+		};
+
+		//Only rows the same modulo spacing share a neighborhood, so each of those phases has its own running column sums
+		int phases = even ? std::min(spacing, height) : 0;
+		std::vector<double> columnSums((size_t)phases * width, 0.0);
+		std::vector<double> columnSquares((size_t)phases * width, 0.0);
+
+		//The column sums of a batch of rows are kept so the rows can be finished in parallel
+		std::vector<double> batchSums((size_t)VARIANCE_BATCH * width);
+		std::vector<double> batchSquares((size_t)VARIANCE_BATCH * width);
+		std::vector<int> batchRows(VARIANCE_BATCH);
+		std::vector<float> variances((size_t)VARIANCE_BATCH * width);
+
+		for (int first = 0; first < height; first += VARIANCE_BATCH)
+		{
+			int last = std::min(height, first + VARIANCE_BATCH);
+			for (int y = first; y < last; y++)
+			{
+				window.moveTo(y);
+				double* rowSums = batchSums.data() + (size_t)(y - first) * width;
+				double* rowSquares = batchSquares.data() + (size_t)(y - first) * width;
+				if (!even)
+				{
+					std::fill(rowSums, rowSums + width, 0.0);
+					std::fill(rowSquares, rowSquares + width, 0.0);
+					int rows = 0;
+					for (int offsetY : offsets)
+					{
+						if (y + offsetY >= 0 && y + offsetY < height)
+						{
+							addRow(y + offsetY, 1.0, rowSums, rowSquares);
+							rows++;
+						}
+					}
+					batchRows[y - first] = rows;
+					continue;
+				}
+
+				int phase = y % spacing;
+				double* sums = columnSums.data() + (size_t)phase * width;
+				double* squares = columnSquares.data() + (size_t)phase * width;
+				if (y < spacing)
+				{
+					//The phase's first row: the rows in reach above it are off the image
+					for (int neighborY = y; neighborY <= std::min(height - 1, y + radius); neighborY += spacing)
+					{
+						addRow(neighborY, 1.0, sums, squares);
+					}
+				}
+				else
+				{
+					if (y + radius < height)
+						addRow(y + radius, 1.0, sums, squares);
+					if (y - spacing - radius >= 0)
+						addRow(y - spacing - radius, -1.0, sums, squares);
+				}
+
+				int top = y - std::min(radius, y / spacing * spacing); //The rows in reach that are in the image
+				int bottom = y + std::min(radius, (height - 1 - y) / spacing * spacing);
+				batchRows[y - first] = (bottom - top) / spacing + 1;
+				std::copy(sums, sums + width, rowSums);
+				std::copy(squares, squares + width, rowSquares);
+			}
+
+			parallelFor(first, last, [&](int firstRow, int lastRow)
+			{
+				for (int y = firstRow; y < lastRow; y++)
+				{
+					const double* sums = batchSums.data() + (size_t)(y - first) * width;
+					const double* squares = batchSquares.data() + (size_t)(y - first) * width;
+					float* row = variances.data() + (size_t)(y - first) * width;
+					int rows = batchRows[y - first];
+					auto variance = [&](double sum, double sumOfSquares, int columns)
+					{
+						double count = (double)rows * columns;
+						double mean = sum / count;
+						return (float)std::max(0.0, sumOfSquares / count - mean * mean);
+					};
+
+					if (!even)
+					{
+						for (int x = 0; x < width; x++)
+						{
+							double sum = 0.0;
+							double sumOfSquares = 0.0;
+							int columns = 0;
+							for (int offsetX : offsets)
+							{
+								if (x + offsetX >= 0 && x + offsetX < width)
+								{
+									sum += sums[x + offsetX];
+									sumOfSquares += squares[x + offsetX];
+									columns++;
+								}
+							}
+							row[x] = variance(sum, sumOfSquares, columns);
+						}
+						continue;
+					}
+
+					//Slide a window of columns along each phase of the row: one column comes in and one goes out per pixel
+					for (int phaseX = 0; phaseX < std::min(spacing, width); phaseX++)
+					{
+						double sum = 0.0;
+						double sumOfSquares = 0.0;
+						int columns = 0;
+						for (int x = phaseX; x <= std::min(width - 1, phaseX + radius); x += spacing)
+						{
+							sum += sums[x];
+							sumOfSquares += squares[x];
+							columns++;
+						}
+
+						for (int x = phaseX; x < width; x += spacing)
+						{
+							row[x] = variance(sum, sumOfSquares, columns);
+							if (x + spacing + radius < width)
+							{
+								sum += sums[x + spacing + radius];
+								sumOfSquares += squares[x + spacing + radius];
+								columns++;
+							}
+							if (x - radius >= 0)
+							{
+								sum -= sums[x - radius];
+								sumOfSquares -= squares[x - radius];
+								columns--;
+							}
+						}
+					}
+				}
+			}, 4);
+
+			for (int y = first; y < last; y++)
+			{
+				sink(y, variances.data() + (size_t)(y - first) * width);
+			}
+		}
+	}
+}
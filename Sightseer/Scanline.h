@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "Parallel.h"
+
+/*
+Passes over an image that only ever look at a few rows around the one they're working on.
+
+Finding the extrema and the variances of the neighborhoods reads k rows to finish one, so they don't need the whole image:
+rows are read in order from a RowSource into a RowWindow that holds just the k rows in reach,
+and every finished row is handed to a sink as soon as it's done.
+That keeps what they allocate to O(width * k), and the source can make its rows as it goes instead of keeping a plane around.
+*/
+
+namespace Eisel
+{
+	//Fills 'row' (width values) with row y. Rows are asked for in order, each once.
+	typedef std::function<void(int y, float* row)> RowSource;
+
+	/*
+	The rows within 'reach' of the current one, kept in a ring of 2 * reach + 1 rows.
+	*/
+	class RowWindow
+	{
+	public:
+		RowWindow(int width, int height, int reach, const RowSource& source);
+
+		void moveTo(int y); //Reads what's still missing of rows y - reach to y + reach. y only goes up.
+		const float* row(int y) const { return rows.data() + (size_t)(y % span) * width; } //Only for rows in the window
+
+	private:
+		int width;
+		int height;
+		int reach;
+		int span;
+		int loaded; //Rows before this one have been read
+		RowSource source;
+		std::vector<float> rows;
+	};
+
+	/*
+	The local minima and maxima of the values, a row at a time.
+	A pixel is a minimum if at most 'rank' of the pixels at 'offsets' around it (along each axis, clipped to the image) are smaller,
+	and a maximum if at most 'rank' are larger. See Canvas::findMinima.
+	The sinks get every row's flags in order, 1 for an extremum and 0 otherwise. Either can be empty, to only find the other.
+	*/
+	typedef std::function<void(int y, const int* flags)> FlagSink;
+	void streamExtrema(int width, int height, const std::vector<int>& offsets, int rank, const RowSource& source,
+		const FlagSink& minimaSink, const FlagSink& maximaSink);
+
+	/*
+	The variance of every pixel's neighborhood (center included), a row at a time.
+	The neighborhood is the pixels at 'offsets' along each axis, clipped to the image (see Canvas::neighborhoodOffsets).
+	They have to be symmetric around 0.
+	When they're evenly spaced, which they are for full neighborhoods, it takes the same time for any k:
+	the sums of every column of the neighborhood are kept up to date as rows come into reach and go out of it,
+	and a window of those columns slides along each row, a column in and a column out per pixel.
+	A dilated neighborhood that isn't evenly spaced adds up its rows and columns directly instead,
+	which only depends on the number of taps, not on k.
+	The rows are finished VARIANCE_BATCH at a time in parallel. The sums are in double, with an average taken off the values first,
+	because the variance is the difference of two sums that are nearly the same.
+	sink gets every row's variances in order.
+	*/
+	const int VARIANCE_BATCH = 64;
+	typedef std::function<void(int y, const float* variances)> VarianceSink;
+	void streamVariances(int width, int height, const std::vector<int>& offsets, const RowSource& source, const VarianceSink& sink);
+}
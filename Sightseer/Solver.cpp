@@ -0,0 +1,326 @@
+#include "Solver.h"
+
+using namespace Eigen;
+
+namespace Eisel
+{
+	/*
+	Dot products are worked out in chunks of this many elements.
+	The chunks don't depend on the thread count, and neither does the order their results are added up in.
+	*/
+	const int REDUCTION_CHUNK = 4096;
+
+	/*
+	How far each of refinedBicgstab's float solves takes the residual down.
+	Every step gains about this factor, so smaller means fewer steps that each take longer.
+	*/
+	const float REFINEMENT_INNER_TOLERANCE = 1e-4f;
+
+	/*
+	Runs kernel(first, last, sums) on every chunk of [0, n) in parallel.
+	The kernel adds its chunk's 'count' results into sums[0..count), which start at 0,
+	and the results of all the chunks are added up in order into 'totals'.
+	*/
+	static void reduceChunks(int n, int count, double* totals, const std::function<void(int, int, double*)>& kernel)
+	{
+		int chunks = (n + REDUCTION_CHUNK - 1) / REDUCTION_CHUNK;
+		std::vector<double> partials((size_t)chunks * count, 0.0);
+		parallelFor(0, chunks, [&](int firstChunk, int lastChunk)
+		{
+			for (int chunk = firstChunk; chunk < lastChunk; chunk++)
+			{
+				kernel(chunk * REDUCTION_CHUNK, std::min(n, (chunk + 1) * REDUCTION_CHUNK), &partials[(size_t)chunk * count]);
+			}
+		});
+
+		std::fill(totals, totals + count, 0.0);
+		for (int chunk = 0; chunk < chunks; chunk++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				totals[i] += partials[(size_t)chunk * count + i];
+			}
+		}
+	}
+
+	//The elementwise passes use big blocks so each thread streams through a long stretch of every vector
+	static void forEachBlock(int n, const std::function<void(int, int)>& kernel)
+	{
+		parallelFor(0, n, kernel, REDUCTION_CHUNK);
+	}
+
+	//Used for both products. The sum is in the vector's precision.
+	template<typename Scalar>
+	static void sparseRows(const SparseRows& A, const Scalar* x, Scalar* y)
+	{
+		const SparseIndex* outer = A.outerIndexPtr();
+		const SparseIndex* inner = A.innerIndexPtr();
+		const float* values = A.valuePtr();
+		const SparseIndex* innerNonZeros = A.innerNonZeroPtr(); //Only there if the matrix isn't compressed
+
+		parallelFor(0, A.rows(), [&](int firstRow, int lastRow)
+		{
+			for (int row = firstRow; row < lastRow; row++)
+			{
+				SparseIndex end = innerNonZeros == nullptr ? outer[row + 1] : outer[row] + innerNonZeros[row];
+				Scalar sum = 0;
+				for (SparseIndex i = outer[row]; i < end; i++)
+				{
+					sum += (Scalar)values[i] * x[inner[i]];
+				}
+				y[row] = sum;
+			}
+		}, 256);
+	}
+
+	void sparseProduct(const SparseRows& A, const float* x, float* y)
+	{
+		sparseRows(A, x, y);
+	}
+
+	void sparseProduct(const SparseRows& A, const double* x, double* y)
+	{
+		sparseRows(A, x, y);
+	}
+
+	//A chunk of a vector as an Eigen array, so the arithmetic on it is vectorized
+	static Map<ArrayXf> chunk(float* data, int first, int last)
+	{
+		return Map<ArrayXf>(data + first, last - first);
+	}
+
+	static Map<const ArrayXf> chunk(const float* data, int first, int last)
+	{
+		return Map<const ArrayXf>(data + first, last - first);
+	}
+
+	static Map<ArrayXd> chunk(double* data, int first, int last)
+	{
+		return Map<ArrayXd>(data + first, last - first);
+	}
+
+	//Dot product of two chunks, added up in double so long sums of floats don't lose their small terms
+	static double dot(const float* a, const float* b, int first, int last)
+	{
+		return (chunk(a, first, last).cast<double>() * chunk(b, first, last).cast<double>()).sum();
+	}
+
+	bool parallelBicgstab(const MatrixProduct& multiply, const float* inverseDiagonal, const VectorXf& rhs, VectorXf& x,
+		int& iters, float& tolError, const SolverMonitor& monitor, const MatrixProduct& precondition, BicgstabVectors* vectors)
+	{
+		int n = rhs.size();
+		float tol = tolError;
+		int maxIters = iters;
+
+		BicgstabVectors ownVectors;
+		if (vectors == nullptr)
+			vectors = &ownVectors;
+		VectorXf& r = vectors->r;
+		VectorXf& r0 = vectors->r0;
+		VectorXf& p = vectors->p;
+		VectorXf& v = vectors->v;
+		VectorXf& s = vectors->s;
+		VectorXf& t = vectors->t;
+		r.resize(n);
+		r0.resize(n);
+		p.setZero(n);
+		v.setZero(n);
+		s.resize(n);
+		t.resize(n);
+		//Without a preconditioner y and z would just be copies of p and s, so they're skipped (but not freed, in case the next solve wants them)
+		bool preconditioned = inverseDiagonal != nullptr || precondition;
+		if (preconditioned)
+		{
+			vectors->y.resize(n);
+			vectors->z.resize(n);
+		}
+		float* yData = preconditioned ? vectors->y.data() : p.data();
+		float* zData = preconditioned ? vectors->z.data() : s.data();
+
+		//r = r0 = b - A * x
+		double sums[2];
+		multiply(x.data(), r.data());
+		reduceChunks(n, 2, sums, [&](int first, int last, double* partial)
+		{
+			chunk(r.data(), first, last) = chunk(rhs.data(), first, last) - chunk(r.data(), first, last);
+			chunk(r0.data(), first, last) = chunk(r.data(), first, last);
+			partial[0] += dot(r.data(), r.data(), first, last);
+			partial[1] += dot(rhs.data(), rhs.data(), first, last);
+		});
+		double r0SqNorm = sums[0];
+		double rhsSqNorm = sums[1];
+		if (rhsSqNorm == 0)
+		{
+			x.setZero();
+			iters = 0;
+			tolError = 0;
+			return true;
+		}
+		double rSqNorm = r0SqNorm;
+		double rhoNext = r0SqNorm; //r0.dot(r), worked out at the end of each iteration for the next one
+
+		//The scalars are all double. Only the vectors are float.
+		double rho = 1;
+		double alpha = 1;
+		double w = 1;
+
+		double tol2 = (double)tol * tol;
+		double eps2 = NumTraits<float>::epsilon() * NumTraits<float>::epsilon();
+		int i = 0;
+		int restarts = 0;
+		bool stopped = false;
+
+		while (rSqNorm / rhsSqNorm > tol2 && i < maxIters)
+		{
+			double rhoOld = rho;
+
+			rho = rhoNext;
+			if (std::abs(rho) < eps2 * r0SqNorm)
+			{
+				//The residual became too orthogonal to r0, so restart with a new r0
+				r0 = r;
+				rho = r0SqNorm = rSqNorm;
+				if (restarts++ == 0)
+					i = 0;
+			}
+			double beta = (rho / rhoOld) * (alpha / w);
+
+			//p = r + beta * (p - w * v), y = M^-1 * p
+			forEachBlock(n, [&](int first, int last)
+			{
+				chunk(p.data(), first, last) = chunk(r.data(), first, last) + (float)beta * (chunk(p.data(), first, last) - (float)w * chunk(v.data(), first, last));
+				if (inverseDiagonal != nullptr)
+					chunk(yData, first, last) = chunk(inverseDiagonal, first, last) * chunk(p.data(), first, last);
+			});
+			if (precondition)
+				precondition(p.data(), yData);
+			multiply(yData, v.data());
+
+			reduceChunks(n, 1, sums, [&](int first, int last, double* partial)
+			{
+				partial[0] += dot(r0.data(), v.data(), first, last);
+			});
+			alpha = rho / sums[0];
+
+			//s = r - alpha * v, z = M^-1 * s
+			forEachBlock(n, [&](int first, int last)
+			{
+				chunk(s.data(), first, last) = chunk(r.data(), first, last) - (float)alpha * chunk(v.data(), first, last);
+				if (inverseDiagonal != nullptr)
+					chunk(zData, first, last) = chunk(inverseDiagonal, first, last) * chunk(s.data(), first, last);
+			});
+			if (precondition)
+				precondition(s.data(), zData);
+			multiply(zData, t.data());
+
+			//t.squaredNorm() and t.dot(s) in one go
+			reduceChunks(n, 2, sums, [&](int first, int last, double* partial)
+			{
+				partial[0] += dot(t.data(), t.data(), first, last);
+				partial[1] += dot(t.data(), s.data(), first, last);
+			});
+			double tmp = sums[0];
+			if (tmp > 0.0)
+				w = sums[1] / tmp;
+			else
+				w = 0.0;
+
+			//x += alpha * y + w * z, r = s - w * t, along with r.squaredNorm() and r0.dot(r) for the next iteration
+			reduceChunks(n, 2, sums, [&](int first, int last, double* partial)
+			{
+				chunk(x.data(), first, last) += (float)alpha * chunk(yData, first, last) + (float)w * chunk(zData, first, last);
+				chunk(r.data(), first, last) = chunk(s.data(), first, last) - (float)w * chunk(t.data(), first, last);
+				partial[0] += dot(r.data(), r.data(), first, last);
+				partial[1] += dot(r0.data(), r.data(), first, last);
+			});
+			rSqNorm = sums[0];
+			rhoNext = sums[1];
+			++i;
+
+			if (monitor && !monitor(i, (float)std::sqrt(rSqNorm / rhsSqNorm)))
+			{
+				stopped = true;
+				break;
+			}
+		}
+		tolError = (float)std::sqrt(rSqNorm / rhsSqNorm);
+		iters = i;
+		return !stopped;
+	}
+
+	bool refinedBicgstab(const MatrixProduct& multiply, const DoubleMatrixProduct& multiplyDouble, const float* inverseDiagonal, const VectorXf& rhs, VectorXd& x,
+		int& steps, double& tolError, const SolverMonitor& monitor, const MatrixProduct& precondition)
+	{
+		int n = rhs.size();
+		double tol = tolError;
+		int maxSteps = steps;
+
+		double sums[1];
+		reduceChunks(n, 1, sums, [&](int first, int last, double* partial)
+		{
+			partial[0] += dot(rhs.data(), rhs.data(), first, last);
+		});
+		double rhsNorm = std::sqrt(sums[0]);
+
+		x = VectorXd::Zero(n);
+		if (rhsNorm == 0.0)
+		{
+			steps = 0;
+			tolError = 0;
+			return true;
+		}
+
+		VectorXd residual(n);
+		VectorXf correctionRhs(n), correction(n);
+		double relativeResidual = 1.0;
+		int step = 0;
+		int totalIterations = 0;
+		while (true)
+		{
+			//The residual of the double solution, worked out in double
+			multiplyDouble(x.data(), residual.data());
+			reduceChunks(n, 1, sums, [&](int first, int last, double* partial)
+			{
+				chunk(residual.data(), first, last) = chunk(rhs.data(), first, last).cast<double>() - chunk(residual.data(), first, last);
+				partial[0] += chunk(residual.data(), first, last).square().sum();
+			});
+			relativeResidual = std::sqrt(sums[0]) / rhsNorm;
+			if (relativeResidual <= tol || step >= maxSteps)
+				break;
+
+			//Solve for the error in float. It only has to be roughly right, the next step fixes what's left.
+			correctionRhs = residual.cast<float>();
+			correction.setZero();
+			int iterations = n;
+			float innerTolerance = REFINEMENT_INNER_TOLERANCE;
+			double scale = relativeResidual; //The inner solve's residual is relative to this step's residual, not to b
+			bool completed = parallelBicgstab(multiply, inverseDiagonal, correctionRhs, correction, iterations, innerTolerance, [&](int iteration, float inner)
+			{
+				return !monitor || monitor(totalIterations + iteration, (float)(inner * scale));
+			}, precondition);
+			totalIterations += iterations;
+			if (!completed)
+			{
+				steps = step;
+				tolError = relativeResidual;
+				return false;
+			}
+
+			/*
+			If the float solve couldn't even get its own residual under 1 (or blew up, which BiCGSTAB can on nearly singular systems),
+			the correction would only make x worse, so we stop with what we have.
+			*/
+			if (!(innerTolerance < 1.0f))
+				break;
+
+			parallelFor(0, n, [&](int first, int last)
+			{
+				chunk(x.data(), first, last) += chunk(correction.data(), first, last).cast<double>();
+			}, REDUCTION_CHUNK);
+			step++;
+		}
+		steps = step;
+		tolError = relativeResidual;
+		return true;
+	}
+}
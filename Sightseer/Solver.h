@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cmath>
+#include <functional>
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+#include "Parallel.h"
+
+/*
+Our own copy of the loop in Eigen's internal::bicgstab (Eigen/src/IterativeLinearSolvers/BiCGSTAB.h).
+
+The maths is exactly the same, so the results match BiCGSTAB::solve.
+The only difference is 'monitor', which gets called after every iteration with the iteration count
+and the current relative residual. If it returns false the solver stops where it is.
+That's what lets a long solve show progress and be cancelled.
+
+parallelBicgstab below is the same method written for our systems specifically, with every step run in parallel.
+*/
+
+namespace Eisel
+{
+	typedef std::function<bool(int iteration, float relativeResidual)> SolverMonitor;
+
+	/*
+	@params
+	mat			the matrix A
+	rhs			the right hand side b
+	x			the initial guess on input, the solution on output
+	precond		an already computed preconditioner for A
+	iters		the maximum number of iterations on input, the number performed on output
+	tolError	the tolerance on input, the estimated relative error on output
+	monitor		see above. May be empty.
+	@returns	false if the monitor stopped the solve, true otherwise
+	*/
+	template<typename MatrixType, typename Rhs, typename Dest, typename Preconditioner>
+	bool bicgstab(const MatrixType& mat, const Rhs& rhs, Dest& x, const Preconditioner& precond,
+		int& iters, typename Dest::RealScalar& tolError, const SolverMonitor& monitor)
+	{
+		typedef typename Dest::RealScalar RealScalar;
+		typedef typename Dest::Scalar Scalar;
+		typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> VectorType;
+		RealScalar tol = tolError;
+		int maxIters = iters;
+
+		int n = mat.cols();
+		VectorType r = rhs - mat * x;
+		VectorType r0 = r;
+
+		RealScalar r0SqNorm = r0.squaredNorm();
+		RealScalar rhsSqNorm = rhs.squaredNorm();
+		if (rhsSqNorm == 0)
+		{
+			x.setZero();
+			iters = 0;
+			tolError = 0;
+			return true;
+		}
+		Scalar rho = 1;
+		Scalar alpha = 1;
+		Scalar w = 1;
+
+		VectorType v = VectorType::Zero(n), p = VectorType::Zero(n);
+		VectorType y(n), z(n);
+		VectorType s(n), t(n);
+
+		RealScalar tol2 = tol * tol;
+		RealScalar eps2 = Eigen::NumTraits<Scalar>::epsilon() * Eigen::NumTraits<Scalar>::epsilon();
+		int i = 0;
+		int restarts = 0;
+		bool stopped = false;
+
+		while (r.squaredNorm() / rhsSqNorm > tol2 && i < maxIters)
+		{
+			Scalar rhoOld = rho;
+
+			rho = r0.dot(r);
+			if (std::abs(rho) < eps2 * r0SqNorm)
+			{
+				//The residual became too orthogonal to r0, so restart with a new r0
+				r0 = r;
+				rho = r0SqNorm = r.squaredNorm();
+				if (restarts++ == 0)
+					i = 0;
+			}
+			Scalar beta = (rho / rhoOld) * (alpha / w);
+			p = r + beta * (p - w * v);
+
+			y = precond.solve(p);
+			v.noalias() = mat * y;
+
+			alpha = rho / r0.dot(v);
+			s = r - alpha * v;
+
+			z = precond.solve(s);
+			t.noalias() = mat * z;
+
+			RealScalar tmp = t.squaredNorm();
+			if (tmp > RealScalar(0))
+				w = t.dot(s) / tmp;
+			else
+				w = Scalar(0);
+			x += alpha * y + w * z;
+			r = s - w * t;
+			++i;
+
+			if (monitor && !monitor(i, std::sqrt(r.squaredNorm() / rhsSqNorm)))
+			{
+				stopped = true;
+				break;
+			}
+		}
+		tolError = std::sqrt(r.squaredNorm() / rhsSqNorm);
+		iters = i;
+		return !stopped;
+	}
+
+	//Computes y = A * x for some matrix A. x and y are both A.cols() long and don't overlap.
+	typedef std::function<void(const float* x, float* y)> MatrixProduct;
+	typedef std::function<void(const double* x, double* y)> DoubleMatrixProduct;
+
+	/*
+	The index type of the sparse matrices (MATRIX_SPARSE and the systems of split off components).
+	Eigen's default is int, whose positions run out at 2^31 non-zeros: 86 million pixels at k = 5, or about 9300 x 9300,
+	long before the pixel numbers themselves do. Building with EISEL_64BIT_INDICES makes them 64-bit,
+	for a third more memory per non-zero. Without it, planDecomposition tiles anything that would overflow.
+	*/
+#ifdef EISEL_64BIT_INDICES
+	typedef std::ptrdiff_t SparseIndex;
+#else
+	typedef int SparseIndex;
+#endif
+	typedef Eigen::SparseMatrix<float, Eigen::ColMajor, SparseIndex> SparseColumns;
+	typedef Eigen::SparseMatrix<float, Eigen::RowMajor, SparseIndex> SparseRows;
+
+	//A row-partitioned product for a row major sparse matrix, split between threads by blocks of rows
+	void sparseProduct(const SparseRows& A, const float* x, float* y);
+	void sparseProduct(const SparseRows& A, const double* x, double* y);
+
+	/*
+	BiCGSTAB again, with the same inputs, outputs and stopping rule as bicgstab above, but made for speed:
+	- The matrix is only used through 'multiply', which is expected to be parallel itself (sparseProduct, StencilMatrix::multiply).
+	- Every vector operation runs in parallel, and they're fused so an iteration makes 4 passes over the vectors
+	  on top of the 2 products, instead of around 12.
+	- Dot products are summed in fixed size chunks and the chunks are added up in order,
+	  so the result is the same however many threads there are.
+	- The vectors are float but every dot product is accumulated in double and the scalars are double,
+	  so the norms the stopping rule uses don't drift.
+	The preconditioner is a diagonal one, given as the inverse of A's diagonal, or nullptr for none.
+	Any other preconditioner can be given as 'precondition' instead, which computes y = M^-1 * x (see HierarchicalBasis.h).
+	'vectors' are the vectors it works with, or nullptr to allocate its own. Handing it the same ones every time saves allocating them.
+	*/
+	struct BicgstabVectors
+	{
+		Eigen::VectorXf r, r0, p, v, s, t, y, z;
+	};
+
+	bool parallelBicgstab(const MatrixProduct& multiply, const float* inverseDiagonal, const Eigen::VectorXf& rhs, Eigen::VectorXf& x,
+		int& iters, float& tolError, const SolverMonitor& monitor, const MatrixProduct& precondition = MatrixProduct(), BicgstabVectors* vectors = nullptr);
+
+	/*
+	Iterative refinement: solves A * x = b to double precision using float solves.
+	Each step works out the residual b - A * x of the double solution in double (with multiplyDouble),
+	solves A * e = residual roughly with parallelBicgstab, and adds e to x.
+	A float solve on its own stalls somewhere around a relative residual of 1e-7, this keeps going.
+	x starts at 0. The solution is exact for A as stored, so with fp16 weights it's exact for the rounded weights.
+	Refinement stops early if a float solve fails to reduce its residual, so a nearly singular A can't turn x into garbage.
+	tolError says how far it got then, which is 1 if the very first one failed and x is still 0.
+	@params
+	steps		the maximum number of refinement steps on input, the number performed on output
+	tolError	the tolerance on input, the true relative residual on output
+	monitor		called from the float solves with the iteration count so far and the overall relative residual
+	*/
+	bool refinedBicgstab(const MatrixProduct& multiply, const DoubleMatrixProduct& multiplyDouble, const float* inverseDiagonal, const Eigen::VectorXf& rhs, Eigen::VectorXd& x,
+		int& steps, double& tolError, const SolverMonitor& monitor, const MatrixProduct& precondition = MatrixProduct());
+}
@@ -0,0 +1,238 @@
+#include "StencilMatrix.h"
+
+using namespace Eigen;
+using namespace Eisel;
+
+/*
+'offsets' are the neighborhood offsets along each axis (see Canvas::neighborhoodOffsets).
+Tap tapIndex(i, j) is the neighbor at (offsets[i], offsets[j]). All weights start at 0.
+*/
+StencilMatrix::StencilMatrix(int width, int height, std::vector<int>& offsets)
+{
+	reset(width, height, offsets);
+}
+
+void StencilMatrix::reset(int width, int height, std::vector<int>& offsets)
+{
+	this->width = width;
+	this->height = height;
+	res = width * height;
+
+	offsetCount = offsets.size();
+	tapX.clear();
+	tapY.clear();
+	for (int offsetX : offsets)
+	{
+		for (int offsetY : offsets)
+		{
+			tapX.push_back(offsetX);
+			tapY.push_back(offsetY);
+		}
+	}
+	weights.resize(tapX.size());
+	for (std::vector<float>& plane : weights)
+	{
+		if (res > plane.capacity())
+			std::vector<float>().swap(plane); //Growing would copy the old weights over, with both allocated at once
+		plane.assign(res, 0.0f);
+	}
+	halfWeights.clear();
+	rowScales.clear();
+	diagonal.clear();
+}
+
+/*
+IEEE half precision conversions for the weights, which are never bigger than 1.
+fp16's subnormals (anything under 2^-14) are flushed to 0 both ways:
+doing arithmetic on them as floats is very slow on x86, and weights that small don't matter.
+floatToHalf rounds to nearest even.
+halfToFloat is nothing but integer operations, so it vectorizes.
+*/
+static uint16_t floatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+	uint32_t sign = (bits >> 16) & 0x8000;
+	bits &= 0x7fffffff;
+
+	if (bits < 113u << 23) //Under 2^-14
+		return (uint16_t)sign;
+
+	uint32_t oddMantissa = (bits >> 13) & 1;
+	bits += (uint32_t)(15 - 127) * (1u << 23) + 0xfff + oddMantissa; //Rebias the exponent and round
+	return (uint16_t)(sign | std::min(bits >> 13, 0x7bffu)); //Clamped to the biggest fp16 there is
+}
+
+//'bits' is scratch space for 'count' values
+static void halfToFloat(const uint16_t* in, uint32_t* bits, float* out, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t magnitude = in[i] & 0x7fff;
+		uint32_t rebiased = magnitude == 0 ? 0 : (magnitude << 13) + ((127 - 15) << 23);
+		bits[i] = rebiased | (uint32_t)(in[i] & 0x8000) << 16;
+	}
+	memcpy(out, bits, count * 4);
+}
+
+void StencilMatrix::row(int pixel, std::vector<int>& columns, std::vector<float>& values) const
+{
+	int x = pixel % width;
+	int y = pixel / width;
+	for (int tap = 0; tap < tapX.size(); tap++)
+	{
+		float weight = weights[tap][pixel];
+		if (weight == 0.0f)
+			continue; //Includes every tap outside the image
+
+		columns.push_back((y + tapY[tap]) * width + x + tapX[tap]);
+		values.push_back(weight);
+	}
+}
+
+/*
+Swaps the float weights for fp16 ones with a scale per row (see halfWeights).
+Weights under about 6e-5 of their row's biggest become 0.
+
+Every row of the interpolation matrix adds up to 0 (1 in the rows of extrema),
+and the solution is very sensitive to that: rounding the weights on their own shifts envelopes by several L.
+So the diagonal stays float, and takes up whatever the rounding added or took away from the rest of its row.
+
+The planes are converted one at a time and each float plane is freed as soon as it's done,
+so on top of the float weights this only ever has one fp16 plane and 8 bytes a pixel of rounding errors.
+*/
+void StencilMatrix::compressWeights()
+{
+	if (weights.empty())
+		return;
+
+	int taps = tapX.size();
+	int centerTap = -1;
+	for (int tap = 0; tap < taps; tap++)
+	{
+		if (tapX[tap] == 0 && tapY[tap] == 0)
+			centerTap = tap;
+	}
+
+	rowScales.resize(res);
+	parallelFor(0, res, [&](int first, int last)
+	{
+		for (int i = first; i < last; i++)
+		{
+			float biggest = 0.0f;
+			for (int tap = 0; tap < taps; tap++)
+			{
+				if (tap != centerTap)
+					biggest = std::max(biggest, std::abs(weights[tap][i]));
+			}
+
+			//A power of two, so scaling doesn't round anything
+			int exponent = 0;
+			std::frexp(biggest, &exponent);
+			rowScales[i] = biggest > 0.0f ? std::ldexp(1.0f, exponent) : 1.0f;
+		}
+	}, 1024);
+
+	std::vector<double> roundingErrors(res, 0.0);
+	halfWeights.resize(taps);
+	for (int tap = 0; tap < taps; tap++)
+	{
+		const std::vector<float>& plane = weights[tap];
+		std::vector<uint16_t>& halfPlane = halfWeights[tap];
+		if (tap != centerTap)
+			halfPlane.resize(res);
+		parallelFor(0, res, [&](int first, int last)
+		{
+			for (int i = first; i < last; i++)
+			{
+				uint16_t half = 0;
+				if (tap != centerTap)
+				{
+					half = floatToHalf(plane[i] / rowScales[i]);
+					halfPlane[i] = half;
+				}
+
+				uint32_t bits;
+				float rounded;
+				halfToFloat(&half, &bits, &rounded, 1);
+				roundingErrors[i] += (double)plane[i] - (double)rounded * rowScales[i];
+			}
+		}, 1024);
+		std::vector<float>().swap(weights[tap]);
+	}
+	weights.clear();
+
+	//The center's own weight is part of the "error", since it wasn't stored
+	if (centerTap >= 0)
+		diagonal.assign(roundingErrors.begin(), roundingErrors.end());
+}
+
+//y = A * x. Both are 'res' long and mustn't overlap.
+void StencilMatrix::multiply(const float* x, float* y) const
+{
+	multiplyRows(x, y);
+}
+
+void StencilMatrix::multiply(const double* x, double* y) const
+{
+	multiplyRows(x, y);
+}
+
+template<typename Scalar>
+void StencilMatrix::multiplyRows(const Scalar* x, Scalar* y) const
+{
+	typedef Array<Scalar, Dynamic, 1> ArrayType;
+	int taps = tapX.size();
+	bool compressed = weights.empty();
+	int skippedTap = -1; //The fp16 plane of the diagonal is all 0, the float one is used instead
+	for (int tap = 0; tap < taps && compressed && !diagonal.empty(); tap++)
+	{
+		if (tapX[tap] == 0 && tapY[tap] == 0)
+			skippedTap = tap;
+	}
+
+	parallelFor(0, height, [&](int firstRow, int lastRow)
+	{
+		std::vector<float> unpacked(compressed ? width : 0); //One row of one tap's weights at a time, back in float
+		std::vector<uint32_t> unpackedBits(compressed ? width : 0);
+
+		for (int row = firstRow; row < lastRow; row++)
+		{
+			Map<ArrayType> result(y + (size_t)row * width, width);
+			result.setZero();
+
+			for (int tap = 0; tap < taps; tap++)
+			{
+				int neighborRow = row + tapY[tap];
+				if (neighborRow < 0 || neighborRow >= height || tap == skippedTap)
+					continue;
+
+				//Only the part of the row whose neighbors are inside the image. The rest has weight 0 anyway.
+				int first = std::max(0, -tapX[tap]);
+				int last = std::min(width, width - tapX[tap]);
+				if (last <= first)
+					continue;
+
+				const float* tapRow;
+				if (compressed)
+				{
+					halfToFloat(halfWeights[tap].data() + (size_t)row * width + first, unpackedBits.data(), unpacked.data() + first, last - first);
+					tapRow = unpacked.data();
+				}
+				else
+				{
+					tapRow = weights[tap].data() + (size_t)row * width;
+				}
+				const Scalar* neighbors = x + (size_t)neighborRow * width + tapX[tap];
+				result.segment(first, last - first) += Map<const ArrayXf>(tapRow + first, last - first).cast<Scalar>() * Map<const ArrayType>(neighbors + first, last - first);
+			}
+
+			if (compressed)
+			{
+				result *= Map<const ArrayXf>(rowScales.data() + (size_t)row * width, width).cast<Scalar>();
+				if (!diagonal.empty())
+					result += Map<const ArrayXf>(diagonal.data() + (size_t)row * width, width).cast<Scalar>() * Map<const ArrayType>(x + (size_t)row * width, width);
+			}
+		}
+	}, 8);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <Eigen/Core>
+#include "Parallel.h"
+
+class StencilMatrix;
+
+//The result of StencilMatrix * VectorXf. Eigen evaluates it straight into the destination, see StencilMatrix::multiply.
+class StencilProduct;
+
+namespace Eigen
+{
+	namespace internal
+	{
+		template<> struct traits<StencilProduct> : traits<VectorXf>
+		{
+			typedef VectorXf ReturnType;
+		};
+	}
+}
+
+/*
+The interpolation matrix stored as a stencil (like the DIA sparse format).
+
+Every row of the matrix belongs to a pixel and has its non-zeros at the same offsets: the pixel's neighborhood.
+So instead of storing a column index with every value like SparseMatrix does,
+we store one plane of weights per neighborhood offset (a "tap"), with one weight per pixel.
+Taps that fall outside the image, and all taps of extrema except the center, have weight 0.
+
+The matrix-vector product then reads every plane and the vector in straight lines, which vectorizes,
+and it's split between threads by image rows.
+
+It works with Eigen's vectors: 'A * x' can be assigned to a VectorXf or used in an expression,
+so Eisel::bicgstab takes it as is.
+
+Once it's filled, compressWeights can store the weights as fp16 to halve the memory they take and the bandwidth the product needs.
+*/
+class StencilMatrix
+{
+public:
+	StencilMatrix(int width, int height, std::vector<int>& offsets);
+
+	void reset(int width, int height, std::vector<int>& offsets); //Same as constructing it again, but keeps the memory it already has
+
+	void multiply(const float* x, float* y) const;
+	void multiply(const double* x, double* y) const; //Same in double, for the residuals of iterative refinement
+	void compressWeights();
+
+	//Only valid until compressWeights is called
+	float* tapWeights(int tap) { return weights[tap].data(); }
+	void row(int pixel, std::vector<int>& columns, std::vector<float>& values) const; //Appends the non-zeros of the pixel's row
+	int tapIndex(int offsetXIndex, int offsetYIndex) const { return offsetXIndex * offsetCount + offsetYIndex; }
+
+	int rows() const { return res; }
+	int cols() const { return res; }
+
+	int width;
+	int height;
+	int res; //Resolution = total number of pixels
+
+	int offsetCount;			//Offsets per axis, so there are offsetCount * offsetCount taps
+	std::vector<int> tapX;		//Neighbor x offset of each tap
+	std::vector<int> tapY;		//Neighbor y offset of each tap
+	std::vector<std::vector<float>> weights;	//One plane of 'res' weights per tap, each allocated on its own so compressWeights can free them one by one
+
+	/*
+	After compressWeights, weights is empty and these hold them instead:
+	the same planes as fp16, with every row of the matrix divided by its own power of two scale
+	so its biggest weight is between 0.5 and 1, where fp16 is most precise.
+	The diagonal is kept in float on its own and isn't scaled. Its fp16 plane is left empty.
+	*/
+	std::vector<std::vector<uint16_t>> halfWeights;
+	std::vector<float> rowScales;
+	std::vector<float> diagonal;
+
+private:
+	template<typename Scalar>
+	void multiplyRows(const Scalar* x, Scalar* y) const;
+};
+
+class StencilProduct : public Eigen::ReturnByValue<StencilProduct>
+{
+public:
+	StencilProduct(const StencilMatrix& matrix, const Eigen::VectorXf& vector) : matrix(matrix), vector(vector) {}
+
+	template<typename Dest>
+	void evalTo(Dest& destination) const
+	{
+		destination.resize(matrix.rows());
+		matrix.multiply(vector.data(), destination.data());
+	}
+
+	int rows() const { return matrix.rows(); }
+	int cols() const { return 1; }
+
+private:
+	const StencilMatrix& matrix;
+	const Eigen::VectorXf& vector;
+};
+
+inline StencilProduct operator*(const StencilMatrix& matrix, const Eigen::VectorXf& vector)
+{
+	return StencilProduct(matrix, vector);
+}
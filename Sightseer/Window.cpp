@@ -30,7 +30,7 @@ Window::Window(const char* windowTitle, int width, int height, int x, int y)
 	}
 	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
 	
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
 
 	windowID = SDL_GetWindowID(sdlWindow);
 	shown = true;
@@ -40,6 +40,8 @@ Window::Window(const char* windowTitle, int width, int height, int x, int y)
 	fullscreen = false;
 
 	img = new Uint32[width * height];
+	lab = new LabImage(width, height);
+	layer = nullptr;
 	
 	imgWidth = width;
 	imgHeight = height;
@@ -62,6 +64,9 @@ Window::Window(const char* windowTitle, int width, int height, int x, int y)
 
 Window::~Window()
 {
+	delete lab;
+	delete layer;
+	delete[] img;
 	SDL_DestroyTexture(texture);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(sdlWindow);
@@ -75,6 +80,7 @@ void Window::fillWithImage(SDL_Surface* surface)
 		img[i] = *((Uint32*)surface->pixels + i);
 	}
 	SDL_UnlockSurface(surface);
+	lab->fromPixels(img);
 }
 
 void Window::fillWithImage(Uint32* image)
@@ -83,6 +89,12 @@ void Window::fillWithImage(Uint32* image)
 	{
 		img[i] = image[i];
 	}
+	lab->fromPixels(img);
+}
+
+void Window::fillWithImage(LabImage* image)
+{
+	lab->copyFrom(image);
 }
 
 void Window::render()
@@ -97,9 +109,32 @@ void Window::render()
 
 void Window::updateTexture()
 {
+	//This is the only place the working image gets converted back to SDL's format
+	lab->toPixels(img);
 	SDL_UpdateTexture(texture, NULL, img, imgWidth * sizeof(Uint32));
 }
 
+/*
+Gives direct access to the texture's pixels, for writing a new frame without going through 'img'.
+'pitch' is set to the length of a row in bytes. Returns nullptr if the texture can't be locked.
+Call unlockTexture when done.
+*/
+Uint32* Window::lockTexture(int& pitch)
+{
+	void* pixels;
+	if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0)
+	{
+		printf("Texture could not be locked! SDL Error: %s\n", SDL_GetError());
+		return nullptr;
+	}
+	return (Uint32*)pixels;
+}
+
+void Window::unlockTexture()
+{
+	SDL_UnlockTexture(texture);
+}
+
 void Window::resizeWindow(int width, int height)
 {
 	width = std::max(width, 400);
@@ -141,10 +176,14 @@ void Window::resizeCanvas(int width, int height)
 	Uint32* newCanvas = new Uint32[imgRes];
 	delete[] img;
 	img = newCanvas;
+	delete lab;
+	lab = new LabImage(width, height);
+	delete layer;
+	layer = nullptr;
 
 	//Create new texture
 	SDL_DestroyTexture(texture);
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height);
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
 }
 
 void Window::resizeWindowAndImg(int width, int height)
@@ -232,8 +271,8 @@ void Window::handleEvent(SDL_Event& e)
 		{
 			ColorRGB rgb;
 			SDL_GetRGB(img[XYtoIndex(x, y)], SDL_GetWindowSurface(sdlWindow)->format, &rgb.r, &rgb.g, &rgb.b);
-			ColorLAB lab = toLAB(rgb);
-			printf("r: %d g: %d b: %d \t l: %lf a: %lf b: %lf\n", rgb.r, rgb.g, rgb.b, lab.l, lab.a, lab.b);
+			int i = XYtoIndex(x, y);
+			printf("r: %d g: %d b: %d \t l: %f a: %f b: %f\n", rgb.r, rgb.g, rgb.b, lab->l[i], lab->a[i], lab->b[i]);
 		}
 	}
 }
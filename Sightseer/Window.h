@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <SDL.h>
 #include "Eisel.h"
+#include "LabImage.h"
 
 using namespace Eisel;
 
@@ -15,7 +16,10 @@ public:
 
 	void fillWithImage(SDL_Surface* image);
 	void fillWithImage(Uint32* image);
+	void fillWithImage(LabImage* image);
 	void updateTexture();
+	Uint32* lockTexture(int& pitch);
+	void unlockTexture();
 	void render();
 
 	void resizeWindow(int width, int height);
@@ -37,7 +41,9 @@ public:
 	int windowWidth;
 	int windowHeight;
 
-	Uint32* img; //The actual pixels being displayed, stored as 4 8-bit unsigned ints
+	LabImage* lab; //The working copy of the image. All of Canvas's algorithms read and write this.
+	LabImage* layer; //For detail windows: the signed, unpacked detail layer that 'lab' displays. nullptr otherwise.
+	Uint32* img; //The actual pixels being displayed, stored as 4 8-bit unsigned ints. Regenerated from 'lab' by updateTexture.
 	int imgWidth;
 	int imgHeight;
 	int imgRes; //Resolution = total number of pixels
@@ -7,12 +7,17 @@
 using namespace std;
 
 const int NEIGHBORHOOD_SIZE = 5;
+const int ENHANCE_LEVELS = 3;		//Number of detail layers in enhancement mode
+const float ENHANCE_MAX_GAIN = 4.0f;	//Gain at the right edge of the window when dragging
+const int DILATED_TAPS = 5;			//Taps per side of a dilated neighborhood, see InterpolationOptions::dilatedTaps
 
 Canvas* canvas;
 Window* activeWindow;
 bool quit = false;
 bool ctrlKeyDown = false;
 bool altKeyDown = false;
+bool enhancing = false;
+int enhanceLayer = 1; //Which of canvas->enhanceLayers the slider controls
 
 void init()
 {
@@ -35,7 +40,8 @@ Window* getNextSelectedWindow()
 
 	while (true)
 	{
-		while (SDL_PollEvent(&e) != 0)
+		//Sleep until there's an event rather than polling
+		while (SDL_WaitEventTimeout(&e, 100) != 0)
 		{
 			canvas->handleEvent(e);
 
@@ -57,9 +63,172 @@ Window* getNextSelectedWindow()
 				}
 			}
 		}
+	}
+}
+
+/*
+Waits for the user to drag out a rectangle on 'window' and stores it in 'region', in image coordinates.
+Returns false if escape was pressed or the window was closed instead.
+*/
+bool getNextSelectedRegion(Window* window, SDL_Rect& region)
+{
+	SDL_Event e;
+	int startX = 0;
+	int startY = 0;
+	bool dragging = false;
+
+	while (true)
+	{
+		while (SDL_WaitEventTimeout(&e, 100) != 0)
+		{
+			canvas->handleEvent(e);
+
+			if (!canvas->hasWindow(window) || (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE))
+			{
+				return false;
+			}
+			else if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT && e.button.windowID == window->windowID)
+			{
+				startX = e.button.x - window->renderTarget.x;
+				startY = e.button.y - window->renderTarget.y;
+				dragging = true;
+			}
+			else if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_LEFT && e.button.windowID == window->windowID && dragging)
+			{
+				int endX = e.button.x - window->renderTarget.x;
+				int endY = e.button.y - window->renderTarget.y;
+				region.x = std::max(0, std::min(startX, endX));
+				region.y = std::max(0, std::min(startY, endY));
+				region.w = std::min(window->imgWidth, std::max(startX, endX) + 1) - region.x;
+				region.h = std::min(window->imgHeight, std::max(startY, endY) + 1) - region.y;
+				if (region.w > 0 && region.h > 0)
+				{
+					return true;
+				}
+				dragging = false;
+			}
+		}
+	}
+}
+
+void printEnhanceGains();
+
+void startEnhancementMode()
+{
+	enhancing = true;
+	enhanceLayer = 1;
+	printf("0-%d: select layer (0 is coarse, 1 is finest detail)\n", ENHANCE_LEVELS);
+	printf("drag across the window or press up/down: change the selected layer's gain\n");
+	printf("e or enter: apply, escape: cancel\n");
+	printEnhanceGains();
+	canvas->showEnhancement();
+}
+
+/*
+Handles the events a background job pushes, see Canvas::runInBackground.
+Progress is printed on one line per stage.
+*/
+void handleJobEvent(SDL_Event& e)
+{
+	static const char* lastStage = nullptr;
+
+	if (e.user.code == JOB_PROGRESS)
+	{
+		const char* stage = (const char*)e.user.data1;
+		if (stage != lastStage && lastStage != nullptr)
+		{
+			printf("\n");
+		}
+		lastStage = stage;
+		printf("\r%s: %d%%", stage, (int)(intptr_t)e.user.data2);
+		fflush(stdout);
+	}
+	else if (e.user.code == JOB_FINISHED)
+	{
+		if (lastStage != nullptr)
+		{
+			printf("\n");
+			lastStage = nullptr;
+		}
 
-		SDL_Delay(100);
+		bool completed = canvas->finishJob();
+		canvas->renderAll();
+		if (!completed && !canvas->jobError.empty())
+		{
+			printf("Failed: %s\n", canvas->jobError.c_str());
+		}
+		else if (!completed)
+		{
+			printf("Cancelled\n");
+		}
+		else if (canvas->enhanceWindow != nullptr && !enhancing)
+		{
+			startEnhancementMode();
+		}
+		else
+		{
+			printf("Done\n");
+		}
+	}
+}
+
+void printEnhanceGains()
+{
+	printf("Gains:");
+	for (int i = 0; i < canvas->enhanceGains.size(); i++)
+	{
+		printf(i == enhanceLayer ? " [%d: %.2f]" : " %d: %.2f", i, canvas->enhanceGains[i]);
+	}
+	printf("\n");
+}
+
+/*
+Handles input while in enhancement mode.
+Returns true if a gain changed and the window needs recomposing.
+*/
+bool handleEnhanceEvent(SDL_Event& e)
+{
+	Window* window = canvas->enhanceWindow;
+	if (window == nullptr) //The window was closed
+	{
+		enhancing = false;
+		return false;
+	}
+
+	if (e.type == SDL_KEYDOWN)
+	{
+		SDL_Keycode key = e.key.keysym.sym;
+		if (key >= SDLK_0 && key <= SDLK_9 && key - SDLK_0 < canvas->enhanceLayers.size())
+		{
+			enhanceLayer = key - SDLK_0;
+			printEnhanceGains();
+		}
+		else if (key == SDLK_UP || key == SDLK_DOWN)
+		{
+			float& gain = canvas->enhanceGains[enhanceLayer];
+			gain = std::max(0.0f, gain + (key == SDLK_UP ? 0.1f : -0.1f));
+			printEnhanceGains();
+			return true;
+		}
+		else if (key == SDLK_e || key == SDLK_RETURN || key == SDLK_ESCAPE)
+		{
+			canvas->stopEnhancing(key != SDLK_ESCAPE); //Escape throws the changes away
+			canvas->renderAll();
+			enhancing = false;
+			printf(key == SDLK_ESCAPE ? "Enhancement cancelled\n" : "Enhancement applied\n");
+		}
+	}
+	else if ((e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK) && e.motion.windowID == window->windowID)
+		|| (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT && e.button.windowID == window->windowID))
+	{
+		//Dragging across the window works as a slider for the selected layer's gain
+		int x = e.type == SDL_MOUSEMOTION ? e.motion.x : e.button.x;
+		float gain = ENHANCE_MAX_GAIN * std::max(0, std::min(window->windowWidth, x)) / window->windowWidth;
+		canvas->enhanceGains[enhanceLayer] = gain;
+		return true;
 	}
+
+	return false;
 }
 
 void setMode(Canvas* canvas, const char mode)
@@ -78,13 +247,96 @@ void setMode(Canvas* canvas, const char mode)
 
 	switch (mode)
 	{
+	case 'a': //Cycle through the interpolation methods: exact, approximate for quick previews, relaxed for when memory is short
+	{
+		const char* names[] = { "exact", "approximate", "relaxed (low memory)" };
+		canvas->interpolation.method = (InterpolationMethod)((canvas->interpolation.method + 1) % (INTERPOLATE_RELAXED + 1));
+		printf("Using %s envelopes\n", names[canvas->interpolation.method]);
+		return;
+	}
+	case 'b': //Benchmark the unknown orderings on this window
+	{
+		LabImage* image = new LabImage(activeWindow->imgWidth, activeWindow->imgHeight);
+		image->copyFrom(activeWindow->lab);
+		canvas->runInBackground([=]() { canvas->benchmarkOrderings(image, NEIGHBORHOOD_SIZE); }, [=](bool) { delete image; });
+		printf("Working, press escape to cancel\n");
+	}
+		return; //handleJobEvent finishes up
 	case 'c': //Clear (source image)
-		activeWindow->fillWithImage(canvas->sourceImageU32);
+		activeWindow->fillWithImage(canvas->sourceImage);
 		activeWindow->updateTexture();
 		break;
-	case 'd': //Multiscale decomposition
-		canvas->runMultiDecomp(activeWindow, NEIGHBORHOOD_SIZE);
-		break;
+	case 'd': //Multiscale decomposition (ctrl: full color, alt: only a region)
+		if (altKeyDown)
+		{
+			bool fullColor = ctrlKeyDown;
+			SDL_Rect region;
+			printf("Drag out the region to decompose\n");
+			bool selected = getNextSelectedRegion(activeWindow, region);
+
+			//The modifier keys were probably let go while selecting, so catch up with them
+			ctrlKeyDown = (SDL_GetModState() & KMOD_LCTRL) != 0;
+			altKeyDown = (SDL_GetModState() & KMOD_LALT) != 0;
+			if (!selected)
+			{
+				break;
+			}
+			printf("Region %d, %d, %d x %d\n", region.x, region.y, region.w, region.h);
+			try
+			{
+				canvas->runMultiDecompInBackground(activeWindow, NEIGHBORHOOD_SIZE, fullColor, &region);
+			}
+			catch (DecompositionTooLarge& e)
+			{
+				printf("%s\n", e.what());
+				break;
+			}
+		}
+		else
+		{
+			try
+			{
+				canvas->runMultiDecompInBackground(activeWindow, NEIGHBORHOOD_SIZE, ctrlKeyDown);
+			}
+			catch (DecompositionTooLarge& e)
+			{
+				printf("%s\n", e.what());
+				break;
+			}
+		}
+		printf("Working, press escape to cancel\n");
+		return; //handleJobEvent finishes up
+	case 'f': //Toggle iterative refinement
+		canvas->interpolation.refine = !canvas->interpolation.refine;
+		printf(canvas->interpolation.refine ? "Refining solves to double precision\n" : "Solving in single precision\n");
+		return;
+	case 'g': //Toggle the hierarchical basis preconditioner
+		canvas->interpolation.preconditioner = canvas->interpolation.preconditioner == PRECONDITION_DIAGONAL ? PRECONDITION_HIERARCHICAL : PRECONDITION_DIAGONAL;
+		printf(canvas->interpolation.preconditioner == PRECONDITION_HIERARCHICAL ? "Preconditioning with a hierarchical basis\n" : "Preconditioning with the diagonal\n");
+		return;
+	case 'h': //Toggle fp16 weights
+		canvas->interpolation.weights = canvas->interpolation.weights == WEIGHTS_FLOAT ? WEIGHTS_HALF : WEIGHTS_FLOAT;
+		printf(canvas->interpolation.weights == WEIGHTS_HALF ? "Storing stencil weights as fp16\n" : "Storing stencil weights as float\n");
+		return;
+	case 'i': //Toggle solving independent parts of the image separately
+		canvas->interpolation.splitComponents = !canvas->interpolation.splitComponents;
+		printf(canvas->interpolation.splitComponents ? "Solving parts walled off by extrema on their own\n" : "Solving the whole image at once\n");
+		return;
+	case 'j': //Compare the preconditioners on this window
+	{
+		LabImage* image = new LabImage(activeWindow->imgWidth, activeWindow->imgHeight);
+		image->copyFrom(activeWindow->lab);
+		canvas->runInBackground([=]() { canvas->comparePreconditioners(image, NEIGHBORHOOD_SIZE); }, [=](bool) { delete image; });
+		printf("Working, press escape to cancel\n");
+	}
+		return; //handleJobEvent finishes up
+	case 'l': //Toggle dilated (lattice) neighborhoods for big k
+		canvas->interpolation.dilatedTaps = canvas->interpolation.dilatedTaps == 0 ? DILATED_TAPS : 0;
+		if (canvas->interpolation.dilatedTaps == 0)
+			printf("Using full neighborhoods\n");
+		else
+			printf("Using dilated neighborhoods of %d x %d taps\n", DILATED_TAPS, DILATED_TAPS);
+		return;
 	case 'm': //Maxima only
 		canvas->fillWithMaximaOnly(activeWindow, NEIGHBORHOOD_SIZE);
 		activeWindow->updateTexture();
@@ -93,13 +345,55 @@ void setMode(Canvas* canvas, const char mode)
 		canvas->fillWithMinimaOnly(activeWindow, NEIGHBORHOOD_SIZE);
 		activeWindow->updateTexture();
 		break;
-	case 'r': //Reconstruct
+	case 'e': //Detail enhancement (ctrl: full color)
+		try
+		{
+			canvas->startEnhancingInBackground(activeWindow, NEIGHBORHOOD_SIZE, ENHANCE_LEVELS, ctrlKeyDown);
+		}
+		catch (DecompositionTooLarge& e)
+		{
+			printf("%s\n", e.what());
+			break;
+		}
+		printf("Working, press escape to cancel\n");
+		return; //handleJobEvent starts enhancement mode once the layers are ready
+	case 'o': //Cycle through the unknown orderings
+	{
+		const char* names[] = { "row major", "Morton (Z-order)", "reverse Cuthill-McKee" };
+		canvas->interpolation.ordering = (UnknownOrdering)((canvas->interpolation.ordering + 1) % (ORDER_RCM + 1));
+		printf("Solving in %s order\n", names[canvas->interpolation.ordering]);
+	}
+		return;
+	case 'p': //Toggle the parallel solver
+		canvas->interpolation.solver = canvas->interpolation.solver == SOLVER_PARALLEL ? SOLVER_EIGEN : SOLVER_PARALLEL;
+		printf(canvas->interpolation.solver == SOLVER_PARALLEL ? "Using the parallel solver\n" : "Using Eigen's solver, one thread per channel\n");
+		return;
+	case 'q': //Compare the approximate and relaxed envelopes against the exact ones
+	{
+		LabImage* image = new LabImage(activeWindow->imgWidth, activeWindow->imgHeight);
+		image->copyFrom(activeWindow->lab);
+		canvas->runInBackground([=]() { canvas->compareInterpolation(image, NEIGHBORHOOD_SIZE); }, [=](bool) { delete image; });
+		printf("Working, press escape to cancel\n");
+	}
+		return; //handleJobEvent finishes up
+	case 's': //Toggle the stencil matrix
+		canvas->interpolation.format = canvas->interpolation.format == MATRIX_STENCIL ? MATRIX_SPARSE : MATRIX_STENCIL;
+		printf(canvas->interpolation.format == MATRIX_STENCIL ? "Solving with the stencil matrix\n" : "Solving with the sparse matrix\n");
+		return;
+	case 'w': //Cycle through the weight kernels
+	{
+		const char* names[] = { "reference", "fast", "fast, checked against the reference" };
+		canvas->interpolation.kernel = (WeightKernel)((canvas->interpolation.kernel + 1) % (KERNEL_CHECKED + 1));
+		printf("Computing weights with the %s kernel\n", names[canvas->interpolation.kernel]);
+	}
+		return;
+	case 'r': //Reconstruct (ctrl: full color)
 	{
 		printf("Select the window to overlay\n");
 		Window* overlayWindow = getNextSelectedWindow();
 		if (overlayWindow != nullptr)
 		{
-			canvas->reconstructFromDecomps(activeWindow, overlayWindow);
+			canvas->reconstructFromDecomps(activeWindow, overlayWindow, ctrlKeyDown);
 			activeWindow->updateTexture();
 		}
 	}
@@ -127,17 +421,38 @@ int main(int argc, char* args[])
 	canvas = new Canvas("Main", "Images/Sunset1.png");
 	setMode(canvas, 'c');
 	printf("\nPress a letter and hit enter:\n");
+	printf("a: switch between exact, approximate (fast preview) and relaxed (low memory) envelopes\n");
+	printf("b: benchmark the solver's pixel orderings\n");
 	printf("c: reset to source image\n");
-	printf("d: run decomposition\n");
+	printf("d: run decomposition (hold ctrl for full color, alt to pick a region)\n");
+	printf("e: enhance details interactively (hold ctrl for full color)\n");
+	printf("f: switch iterative refinement to double precision on and off (parallel solver only)\n");
+	printf("g: switch between the diagonal and hierarchical basis preconditioners\n");
+	printf("h: switch between float and fp16 stencil weights\n");
+	printf("i: switch solving parts of the image walled off by extrema on their own on and off\n");
+	printf("j: compare the preconditioners' iteration counts\n");
+	printf("l: switch between full and dilated neighborhoods (faster for big neighborhoods)\n");
 	printf("m: show maxima only\n");
 	printf("n: show minima only\n");
-	printf("r: recompose detail layer onto current layer\n");
+	printf("o: change the order the solver numbers pixels in\n");
+	printf("p: switch between the parallel solver and Eigen's\n");
+	printf("q: compare approximate and relaxed envelopes against exact ones\n");
+	printf("r: recompose detail layer onto current layer (hold ctrl for full color)\n");
+	printf("s: switch between the stencil and sparse solver matrices\n");
+	printf("w: change how the matrix weights are computed (fast, checked, reference)\n");
 
 	SDL_Event e;
 	while (!quit)
 	{
-		//Handle events on queue
-		while (SDL_PollEvent(&e) != 0)
+		bool enhanceChanged = false;
+
+		//Sleep until something happens, then handle everything on the queue
+		if (SDL_WaitEventTimeout(&e, 100) == 0)
+		{
+			continue;
+		}
+
+		do
 		{
 			if (e.type == SDL_QUIT)
 			{
@@ -146,7 +461,25 @@ int main(int argc, char* args[])
 
 			canvas->handleEvent(e); //Let the window handle resizing and repositioning
 
-			if (e.type == SDL_KEYDOWN)
+			if (e.type == canvas->jobEventType)
+			{
+				handleJobEvent(e);
+			}
+			else if (canvas->busy())
+			{
+				//Only one job at a time. Escape cancels it, everything else waits.
+				if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE)
+				{
+					canvas->cancelJob();
+					printf("\nCancelling...\n");
+				}
+			}
+			else if (enhancing)
+			{
+				//Only recompose once per batch of events, no matter how many slider moves came in
+				enhanceChanged |= handleEnhanceEvent(e);
+			}
+			else if (e.type == SDL_KEYDOWN)
 			{
 				if (e.key.keysym.sym == SDLK_LCTRL)
 				{
@@ -161,7 +494,8 @@ int main(int argc, char* args[])
 					setMode(canvas, e.key.keysym.sym);
 				}
 			}
-			else if (e.type == SDL_KEYUP)
+
+			if (e.type == SDL_KEYUP)
 			{
 				if (e.key.keysym.sym == SDLK_LCTRL)
 				{
@@ -172,9 +506,12 @@ int main(int argc, char* args[])
 					altKeyDown = false;
 				}
 			}
-		}
+		} while (SDL_PollEvent(&e) != 0);
 
-		SDL_Delay(100);
+		if (enhanceChanged && enhancing)
+		{
+			canvas->showEnhancement(); //Presenting waits for vsync, which paces the slider at the display's refresh rate
+		}
 	}
 
 	cleanup();